@@ -0,0 +1,201 @@
+#include <mpi.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <spdlog/spdlog.h>
+#include <tclap/CmdLine.h>
+#include <thallium.hpp>
+
+#include "WorkQueue.hpp"
+#include "DistributedWorkQueue.hpp"
+#include "PrefetchingWorkQueue.hpp"
+
+/**
+ * Measures the work queues in isolation, without HDF5 files or a HEPnOS
+ * service. Rank 0 pushes synthetic work items of a given size, the queue
+ * is made read-only, then every rank pulls items until the queue is empty,
+ * spending an artificial processing time on each of them. Rank 0 can also
+ * clear the queue after some time, as the dataloader does with --timeout.
+ * Reported: push rate, pull rate (items/s served by the queue), percentiles
+ * of the latency of a pull, and the shutdown time, from a rank finding the
+ * queue empty to the destruction of its queue (which, on rank 0 of the
+ * centralized queue, waits for the listener to stop).
+ */
+
+static int         g_rank;        // Rank of this process
+static int         g_size;        // Size of MPI_COMM_WORLD
+static uint64_t    g_num_items;   // Number of work items pushed
+static size_t      g_item_size;   // Size of each work item in bytes
+static double      g_work_time;   // Time (sec) spent processing each item
+static double      g_clear_after; // Time (sec) after which rank 0 clears the queue (0 to never clear it)
+static bool        g_distributed; // Use the DistributedWorkQueue instead of WorkQueue
+static int         g_lookahead;   // Number of items reserved ahead with a PrefetchingWorkQueue
+static size_t      g_bulk;        // Number of items pulled at once (0 to use pull())
+static spdlog::level::level_enum g_logging_level; // Logging level
+
+static void parse_arguments(int argc, char** argv);
+static double percentile(const std::vector<double>& sorted, double p);
+
+int main(int argc, char** argv) {
+
+    int mpi_thread_level;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &mpi_thread_level);
+    MPI_Comm_rank(MPI_COMM_WORLD, &g_rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &g_size);
+    parse_arguments(argc, argv);
+    spdlog::set_level(g_logging_level);
+    if(!g_distributed && g_size > 1 && mpi_thread_level < MPI_THREAD_MULTIPLE) {
+        if(g_rank == 0) spdlog::critical("The centralized queue requires MPI_THREAD_MULTIPLE");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+
+    std::vector<double> latencies; // duration of each pull
+    uint64_t num_pulled = 0;
+    double push_time = 0.0, pull_time = 0.0, shutdown_time = 0.0;
+    {
+        tl::abt scope;
+        double t_empty = 0.0;
+        {
+            std::unique_ptr<AbstractWorkQueue> queue;
+            if(g_distributed)
+                queue.reset(new DistributedWorkQueue(MPI_COMM_WORLD));
+            else
+                queue.reset(new WorkQueue(MPI_COMM_WORLD));
+            if(g_lookahead > 0)
+                queue.reset(new PrefetchingWorkQueue(std::move(queue), g_lookahead));
+
+            double t_start = MPI_Wtime();
+            if(g_rank == 0) {
+                std::string item(g_item_size, 'x');
+                for(uint64_t i = 0; i < g_num_items; i++) queue->push(item);
+            }
+            queue->readonly();
+            push_time = MPI_Wtime() - t_start;
+            MPI_Barrier(MPI_COMM_WORLD);
+            if(g_rank == 0) queue->start_listening();
+
+            latencies.reserve(g_num_items / g_size + 1);
+            bool cleared = false;
+            t_start = MPI_Wtime();
+            try {
+                while(true) {
+                    if(g_rank == 0 && g_clear_after > 0 && !cleared
+                    && MPI_Wtime() - t_start > g_clear_after) {
+                        queue->clear();
+                        cleared = true;
+                    }
+                    double t0 = MPI_Wtime();
+                    size_t count = 1;
+                    if(g_bulk > 0) count = queue->pull_bulk(g_bulk).size();
+                    else queue->pull();
+                    latencies.push_back(MPI_Wtime() - t0);
+                    num_pulled += count;
+                    if(g_work_time > 0)
+                        std::this_thread::sleep_for(std::chrono::duration<double>(g_work_time*count));
+                }
+            } catch(AbstractWorkQueue::EmptyQueueException&) {}
+            t_empty = MPI_Wtime();
+            pull_time = t_empty - t_start;
+        }
+        shutdown_time = MPI_Wtime() - t_empty;
+    }
+
+    // Rank 0 gathers the latencies of all the pulls
+    int local_count = latencies.size();
+    std::vector<int> counts(g_size), offsets(g_size);
+    MPI_Gather(&local_count, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+    std::vector<double> all_latencies;
+    if(g_rank == 0) {
+        int total = 0;
+        for(int r = 0; r < g_size; r++) {
+            offsets[r] = total;
+            total += counts[r];
+        }
+        all_latencies.resize(total);
+    }
+    MPI_Gatherv(latencies.data(), local_count, MPI_DOUBLE, all_latencies.data(), counts.data(),
+                offsets.data(), MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    uint64_t total_pulled = 0;
+    double max_pull_time = 0.0, max_shutdown_time = 0.0;
+    MPI_Reduce(&num_pulled, &total_pulled, 1, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&pull_time, &max_pull_time, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&shutdown_time, &max_shutdown_time, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    spdlog::info("Pulled {} items in {} s, shutdown in {} s", num_pulled, pull_time, shutdown_time);
+
+    if(g_rank == 0) {
+        std::sort(all_latencies.begin(), all_latencies.end());
+        std::cout << "QUEUE: " << (g_distributed ? "distributed" : "centralized")
+                  << " RANKS: " << g_size << " ITEMS: " << total_pulled << "/" << g_num_items
+                  << " SIZE: " << g_item_size << std::endl;
+        std::cout << "PUSH: " << g_num_items/push_time << " ITEMS/S" << std::endl;
+        std::cout << "PULL: " << total_pulled/max_pull_time << " ITEMS/S IN " << max_pull_time << " S" << std::endl;
+        std::cout << "LATENCY (us): P50 " << percentile(all_latencies, 0.50)*1e6
+                  << " P90 " << percentile(all_latencies, 0.90)*1e6
+                  << " P99 " << percentile(all_latencies, 0.99)*1e6
+                  << " MAX " << percentile(all_latencies, 1.0)*1e6 << std::endl;
+        std::cout << "SHUTDOWN: " << max_shutdown_time << " S" << std::endl;
+    }
+    MPI_Finalize();
+    return 0;
+}
+
+static double percentile(const std::vector<double>& sorted, double p) {
+    if(sorted.empty()) return 0.0;
+    size_t i = std::min(sorted.size() - 1, (size_t)(p * (sorted.size() - 1) + 0.5));
+    return sorted[i];
+}
+
+static void parse_arguments(int argc, char** argv) {
+    try {
+
+        TCLAP::CmdLine cmd("Measures the work queues of the HEPnOS dataloader", ' ', "0.5");
+        TCLAP::ValueArg<uint64_t> numItems("n", "items", "Number of work items pushed by rank 0", false, 10000, "int");
+        TCLAP::ValueArg<size_t> itemSize("s", "item-size", "Size of each work item in bytes", false, 128, "int");
+        TCLAP::ValueArg<double> workTime("w", "work-time", "Time (us) spent processing each item", false, 0.0, "float");
+        TCLAP::ValueArg<double> clearAfter("", "clear-after",
+            "Time (sec) after which rank 0 clears the queue (0 to never clear it)", false, 0.0, "float");
+        TCLAP::ValueArg<std::string> queueType("", "queue", "Work queue implementation", false, "centralized",
+                                               "centralized,distributed");
+        TCLAP::ValueArg<int> lookahead("", "lookahead", "Number of items to reserve ahead of the one being processed",
+                                       false, 0, "int");
+        TCLAP::ValueArg<size_t> bulk("", "bulk", "Pull this many items at once (0 to pull them one by one)",
+                                     false, 0, "int");
+        TCLAP::ValueArg<std::string> loggingLevel("v", "verbose", "Logging output type (info, debug, critical)", false, "warning",
+                                                  "trace,debug,info,warning,error,critical,off");
+
+        cmd.add(numItems);
+        cmd.add(itemSize);
+        cmd.add(workTime);
+        cmd.add(clearAfter);
+        cmd.add(queueType);
+        cmd.add(lookahead);
+        cmd.add(bulk);
+        cmd.add(loggingLevel);
+        cmd.parse(argc, argv);
+
+        g_num_items     = numItems.getValue();
+        g_item_size     = itemSize.getValue();
+        g_work_time     = workTime.getValue()/1e6;
+        g_clear_after   = clearAfter.getValue();
+        g_lookahead     = lookahead.getValue();
+        g_bulk          = bulk.getValue();
+        g_logging_level = spdlog::level::from_str(loggingLevel.getValue());
+        if(queueType.getValue() == "distributed") {
+            g_distributed = true;
+        } else if(queueType.getValue() == "centralized") {
+            g_distributed = false;
+        } else {
+            throw TCLAP::ArgException("Invalid work queue type", "queue");
+        }
+
+    } catch(TCLAP::ArgException &e) {
+        if(g_rank == 0) {
+            spdlog::critical("{} for command-line argument {}", e.error(), e.argId());
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+}
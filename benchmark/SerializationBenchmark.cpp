@@ -0,0 +1,174 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <type_traits>
+#include <spdlog/spdlog.h>
+#include <tclap/CmdLine.h>
+#include <hepnos.hpp>
+#include <boost/archive/binary_oarchive.hpp>
+#include <boost/archive/binary_iarchive.hpp>
+
+#define HEPNOS_ENABLE_HDF5
+#ifdef ONLY_TEST_CLASSES
+#include "_test_.hpp"
+#include "_test_macro_.hpp"
+#else
+#include "hepnos-nova-classes/_all_.hpp"
+#include "hepnos-nova-classes/_macro_.hpp"
+#endif
+
+#include "RawProduct.hpp"
+
+/**
+ * Compares, for each NOvA class, the throughput of the two ways products
+ * are serialized by the dataloader: the default path, which writes the
+ * number of rows followed by each row through a Boost binary archive
+ * (as std::vector<T> is serialized), and the --raw-layout path, which
+ * copies the rows of trivially copyable classes after a RawProduct header.
+ * The raw path is measured both as the serializing sinks use it (to_bytes)
+ * and through a binary archive, as HEPnOS serializes it in a WriteBatch.
+ * Each product is read back from the raw bytes and compared with its rows.
+ * Classes that are not trivially copyable only have the default path.
+ */
+
+static size_t   g_rows;          // Number of rows of each product
+static uint64_t g_num_products;  // Number of products serialized per class and path
+static spdlog::level::level_enum g_logging_level; // Logging level
+
+static void parse_arguments(int argc, char** argv);
+
+template<typename Function>
+static double time_products(Function&& serialize, size_t& bytes) {
+    bytes = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    for(uint64_t i = 0; i < g_num_products; i++) bytes += serialize().size();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+static double mb_per_sec(size_t row_bytes, double seconds) {
+    return seconds > 0 ? row_bytes/(1024.0*1024.0)/seconds : 0.0;
+}
+
+template<typename T>
+static void fill_rows(std::vector<T>& rows, std::false_type) {
+    rows.resize(g_rows);
+}
+
+template<typename T>
+static void fill_rows(std::vector<T>& rows, std::true_type) {
+    // Arbitrary bytes, so that the round trip checks every byte of the rows
+    rows.resize(g_rows);
+    std::vector<unsigned char> bytes(rows.size()*sizeof(T));
+    std::mt19937 gen(42);
+    for(auto& b : bytes) b = gen() & 0xff;
+    if(!bytes.empty()) std::memcpy((void*)rows.data(), bytes.data(), bytes.size());
+}
+
+template<typename T>
+static void benchmark_raw(const std::string&, const std::vector<T>&, double, std::false_type) {
+    std::cout << " RAW: n/a (not trivially copyable)" << std::endl;
+}
+
+template<typename T>
+static void benchmark_raw(const std::string& name, const std::vector<T>& rows, double archive_rate, std::true_type) {
+    size_t row_bytes = g_num_products*rows.size()*sizeof(T);
+    size_t raw_bytes = 0, raw_archive_bytes = 0;
+    double raw_time = time_products([&rows]() {
+        return RawProduct<T>::to_bytes(rows.data(), rows.size());
+    }, raw_bytes);
+    double raw_archive_time = time_products([&rows]() {
+        std::stringstream ss;
+        {
+            boost::archive::binary_oarchive oa(ss, boost::archive::no_header);
+            RawProduct<T> product(rows.data(), rows.size());
+            oa << product;
+        }
+        return ss.str();
+    }, raw_archive_bytes);
+
+    // Round trip and identical bytes in both raw paths
+    std::string bytes = RawProduct<T>::to_bytes(rows.data(), rows.size());
+    RawProduct<T> loaded;
+    {
+        std::stringstream ss(bytes);
+        boost::archive::binary_iarchive ia(ss, boost::archive::no_header);
+        ia >> loaded;
+    }
+    bool ok = raw_bytes == raw_archive_bytes && loaded.valid() && loaded.loaded.size() == rows.size()
+           && (rows.empty() || std::memcmp((const void*)loaded.loaded.data(), (const void*)rows.data(),
+                                           rows.size()*sizeof(T)) == 0);
+    if(!ok) spdlog::error("Raw products of {} do not read back as their rows", name);
+
+    double raw_rate = mb_per_sec(row_bytes, raw_time);
+    std::cout << " RAW: " << raw_rate << " MB/S"
+              << " RAW ARCHIVE: " << mb_per_sec(row_bytes, raw_archive_time) << " MB/S"
+              << " RAW SIZE: " << raw_bytes/g_num_products
+              << " SPEEDUP: " << (archive_rate > 0 ? raw_rate/archive_rate : 0.0)
+              << " ROUND TRIP: " << (ok ? "OK" : "FAILED") << std::endl;
+}
+
+template<typename T>
+static void benchmark_class(const std::string& name) {
+    std::vector<T> rows;
+    fill_rows(rows, std::is_trivially_copyable<T>());
+    size_t row_bytes = g_num_products*rows.size()*sizeof(T);
+    size_t archive_bytes = 0;
+    double archive_time = time_products([&rows]() {
+        std::stringstream ss;
+        {
+            boost::archive::binary_oarchive oa(ss, boost::archive::no_header);
+            size_t count = rows.size();
+            oa << count;
+            for(auto& row : rows) oa << row;
+        }
+        return ss.str();
+    }, archive_bytes);
+    double archive_rate = mb_per_sec(row_bytes, archive_time);
+    spdlog::info("Serialized {} products of {} in {} s", g_num_products, name, archive_time);
+    std::cout << "CLASS: " << name << " ROW SIZE: " << sizeof(T)
+              << " ARCHIVE: " << archive_rate << " MB/S"
+              << " ARCHIVE SIZE: " << archive_bytes/g_num_products;
+    benchmark_raw(name, rows, archive_rate, std::is_trivially_copyable<T>());
+}
+
+int main(int argc, char** argv) {
+
+    parse_arguments(argc, argv);
+    spdlog::set_level(g_logging_level);
+    if(g_num_products == 0) return 0;
+
+    std::cout << "ROWS: " << g_rows << " PRODUCTS: " << g_num_products << std::endl;
+#define X(__class__) benchmark_class<__class__>(#__class__);
+    HEPNOS_FOREACH_NOVA_CLASS
+#undef X
+    return 0;
+}
+
+static void parse_arguments(int argc, char** argv) {
+    try {
+
+        TCLAP::CmdLine cmd("Measures the serialization of the products of each NOvA class", ' ', "0.5");
+        TCLAP::ValueArg<size_t> rows("r", "rows", "Number of rows of each product", false, 64, "int");
+        TCLAP::ValueArg<uint64_t> numProducts("n", "products", "Number of products serialized per class and path",
+                                              false, 10000, "int");
+        TCLAP::ValueArg<std::string> loggingLevel("v", "verbose", "Logging output type (info, debug, critical)", false, "warning",
+                                                  "trace,debug,info,warning,error,critical,off");
+
+        cmd.add(rows);
+        cmd.add(numProducts);
+        cmd.add(loggingLevel);
+        cmd.parse(argc, argv);
+
+        g_rows          = rows.getValue();
+        g_num_products  = numProducts.getValue();
+        g_logging_level = spdlog::level::from_str(loggingLevel.getValue());
+
+    } catch(TCLAP::ArgException &e) {
+        spdlog::critical("{} for command-line argument {}", e.error(), e.argId());
+        exit(1);
+    }
+}
@@ -0,0 +1,279 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <spdlog/spdlog.h>
+#include <tclap/CmdLine.h>
+#include <hdf5.h>
+
+#include "Manifest.hpp"
+#include "HDF5Compat.hpp"
+
+/**
+ * Generates synthetic NOvA HDF5 files for benchmarking the dataloader.
+ * The layout of the tables (groups, datasets, types and trailing
+ * dimensions) is cloned from a template file, so that the generated files
+ * can be read by the from_hdf5 functions of the hepnos-nova-classes.
+ * Only the number of rows changes. The run, subrun, evt and subevt columns
+ * are filled consistently with the file name and the requested number of
+ * events; other numeric columns are filled with pseudo-random values, and
+ * non-numeric columns with zeros.
+ */
+
+static std::string              g_template_file;   // File whose layout is cloned
+static std::string              g_output_dir;      // Directory in which to generate files
+static std::string              g_prefix;          // Prefix of the generated file names
+static std::string              g_list_file;       // File in which to write the list of generated files
+static int                      g_num_files;       // Number of files to generate
+static int                      g_subruns_per_run; // Number of files (subruns) per run
+static int                      g_first_run;       // Run number of the first file
+static int                      g_events;          // Events per subrun (i.e. per file)
+static int                      g_rows_per_event;  // Mean number of rows of each table per event
+static unsigned                 g_seed;            // Seed of the random number generator
+static std::vector<std::string> g_product_names;   // Products to generate (default: all tables of the template)
+
+static void parse_arguments(int argc, char** argv);
+static std::vector<std::string> list_tables(hid_t template_file);
+static void generate_file(hid_t template_file, const std::vector<std::string>& tables,
+                          const std::string& filename, int run, int subrun, unsigned seed);
+
+int main(int argc, char** argv) {
+
+    parse_arguments(argc, argv);
+
+    hid_t template_file = H5Fopen(g_template_file.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+    if(template_file < 0) {
+        spdlog::critical("Could not open template file {}", g_template_file);
+        return 1;
+    }
+    std::vector<std::string> tables;
+    if(g_product_names.empty()) {
+        tables = list_tables(template_file);
+    } else {
+        for(auto& p : g_product_names) {
+            std::string group = Manifest::hdf5_group_name(p);
+            if(H5Lexists(template_file, group.c_str(), H5P_DEFAULT) <= 0) {
+                spdlog::critical("Table {} (product {}) not found in template file", group, p);
+                return 1;
+            }
+            tables.push_back(group);
+        }
+    }
+    spdlog::info("Generating {} files with {} tables, {} events per file, {} rows per event",
+                 g_num_files, tables.size(), g_events, g_rows_per_event);
+
+    std::ofstream list(g_list_file);
+    uint64_t total_bytes = 0;
+    for(int i = 0; i < g_num_files; i++) {
+        int run    = g_first_run + i / g_subruns_per_run;
+        int subrun = i % g_subruns_per_run;
+        // The dataloader extracts run and subrun numbers from the file name
+        std::stringstream ss;
+        ss << g_output_dir << "/" << g_prefix
+           << "_r000" << std::setw(5) << std::setfill('0') << run
+           << "_s" << std::setw(2) << std::setfill('0') << subrun
+           << "_synthetic.h5caf.h5";
+        generate_file(template_file, tables, ss.str(), run, subrun, g_seed + i);
+        Manifest::FileInfo info;
+        info.filename = ss.str();
+        Manifest::stat_file(info);
+        total_bytes += info.size;
+        list << ss.str() << "\n";
+        spdlog::debug("Generated file {}", ss.str());
+    }
+    H5Fclose(template_file);
+    spdlog::info("Generated {} files ({} bytes), listed in {}", g_num_files, total_bytes, g_list_file);
+    std::cout << "FILES: " << g_num_files << " EVENTS: " << (uint64_t)g_num_files*g_events
+              << " BYTES: " << total_bytes << std::endl;
+    return 0;
+}
+
+static void parse_arguments(int argc, char** argv) {
+    try {
+
+        TCLAP::CmdLine cmd("Generates synthetic HDF5 files for the HEPnOS dataloader", ' ', "0.5");
+        TCLAP::ValueArg<std::string> templateFile("t", "template", "HDF5 file whose table layout is cloned",
+                                                  true, "", "string");
+        TCLAP::ValueArg<std::string> outputDir("d", "output-dir", "Directory in which to generate files",
+                                               false, ".", "string");
+        TCLAP::ValueArg<std::string> prefix("", "prefix", "Prefix of the generated file names",
+                                            false, "neardet", "string");
+        TCLAP::ValueArg<std::string> listFile("o", "output", "File in which to write the list of generated files",
+                                              true, "", "string");
+        TCLAP::ValueArg<int> numFiles("f", "files", "Number of files to generate", false, 8, "int");
+        TCLAP::ValueArg<int> subrunsPerRun("", "subruns-per-run", "Number of files (subruns) per run",
+                                           false, 64, "int");
+        TCLAP::ValueArg<int> firstRun("", "first-run", "Run number of the first file", false, 10000, "int");
+        TCLAP::ValueArg<int> events("e", "events", "Number of events per subrun (file)", false, 1000, "int");
+        TCLAP::ValueArg<int> rowsPerEvent("r", "rows-per-event", "Mean number of rows of each table per event",
+                                          false, 1, "int");
+        TCLAP::ValueArg<unsigned> seed("", "seed", "Seed of the random number generator", false, 0, "int");
+        TCLAP::MultiArg<std::string> productNames("n", "product-names",
+            "Name of the products to generate (default: all the tables of the template)", false, "string");
+
+        cmd.add(templateFile);
+        cmd.add(outputDir);
+        cmd.add(prefix);
+        cmd.add(listFile);
+        cmd.add(numFiles);
+        cmd.add(subrunsPerRun);
+        cmd.add(firstRun);
+        cmd.add(events);
+        cmd.add(rowsPerEvent);
+        cmd.add(seed);
+        cmd.add(productNames);
+        cmd.parse(argc, argv);
+
+        g_template_file   = templateFile.getValue();
+        g_output_dir      = outputDir.getValue();
+        g_prefix          = prefix.getValue();
+        g_list_file       = listFile.getValue();
+        g_num_files       = std::max(0, numFiles.getValue());
+        g_subruns_per_run = std::min(100, std::max(1, subrunsPerRun.getValue()));
+        g_first_run       = firstRun.getValue();
+        g_events          = std::max(0, events.getValue());
+        g_rows_per_event  = std::max(1, rowsPerEvent.getValue());
+        g_seed            = seed.getValue();
+        g_product_names   = productNames.getValue();
+
+    } catch(TCLAP::ArgException &e) {
+        spdlog::critical("{} for command-line argument {}", e.error(), e.argId());
+        exit(1);
+    }
+}
+
+static herr_t list_tables_cb(hid_t group, const char* name, const H5L_info_t*, void* op_data) {
+    auto tables = static_cast<std::vector<std::string>*>(op_data);
+    if(HDF5Compat::object_type(group, name) == H5O_TYPE_GROUP) tables->push_back(name);
+    return 0;
+}
+
+static std::vector<std::string> list_tables(hid_t template_file) {
+    std::vector<std::string> tables;
+    H5Literate(template_file, H5_INDEX_NAME, H5_ITER_NATIVE, nullptr, &list_tables_cb, &tables);
+    return tables;
+}
+
+/**
+ * Columns of a table being generated, shared by all its datasets.
+ */
+struct TableRows {
+    std::vector<double> run;    // run number of each row
+    std::vector<double> subrun; // subrun number of each row
+    std::vector<double> evt;    // event number of each row
+    std::vector<double> subevt; // index of each row within its event
+    std::mt19937*       rng;    // generator for the other columns
+};
+
+static void generate_dataset(hid_t src_group, hid_t dst_group, const char* name, TableRows& rows) {
+    hid_t src   = H5Dopen(src_group, name, H5P_DEFAULT);
+    hid_t type  = H5Dget_type(src);
+    hid_t space = H5Dget_space(src);
+    hid_t dcpl  = H5Dget_create_plist(src);
+    hsize_t dims[H5S_MAX_RANK], maxdims[H5S_MAX_RANK];
+    int ndims = H5Sget_simple_extent_dims(space, dims, maxdims);
+    H5Sclose(space);
+    size_t num_rows = rows.evt.size();
+    if(ndims < 1) ndims = 1;
+    dims[0] = num_rows;
+    size_t row_elements = 1;
+    for(int i = 1; i < ndims; i++) row_elements *= dims[i];
+    // Chunked datasets need an unlimited first dimension to accept any number
+    // of rows, and compact datasets could not hold more rows than the template
+    H5D_layout_t layout = H5Pget_layout(dcpl);
+    if(layout == H5D_CHUNKED) maxdims[0] = H5S_UNLIMITED;
+    else maxdims[0] = dims[0];
+    if(layout == H5D_COMPACT) H5Pset_layout(dcpl, H5D_CONTIGUOUS);
+    space = H5Screate_simple(ndims, dims, maxdims);
+    hid_t dst = H5Dcreate(dst_group, name, type, space, H5P_DEFAULT, dcpl, H5P_DEFAULT);
+
+    H5T_class_t type_class = H5Tget_class(type);
+    size_t num_elements = num_rows * row_elements;
+    if(num_elements > 0) {
+        if(type_class == H5T_INTEGER || type_class == H5T_FLOAT) {
+            // Numbers are converted by HDF5 from doubles to the type of the dataset
+            std::vector<double> values(num_elements);
+            std::string column = name;
+            std::vector<double>* index = nullptr;
+            if(column == "run")    index = &rows.run;
+            if(column == "subrun") index = &rows.subrun;
+            if(column == "evt")    index = &rows.evt;
+            if(column == "subevt") index = &rows.subevt;
+            std::uniform_int_distribution<int> int_dist(0, 99);
+            std::uniform_real_distribution<double> float_dist(0.0, 1.0);
+            for(size_t i = 0; i < num_elements; i++) {
+                if(index)                        values[i] = (*index)[i / row_elements];
+                else if(type_class == H5T_FLOAT) values[i] = float_dist(*rows.rng);
+                else                             values[i] = int_dist(*rows.rng);
+            }
+            H5Dwrite(dst, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, values.data());
+        } else {
+            std::vector<char> zeros(num_elements * H5Tget_size(type), 0);
+            H5Dwrite(dst, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, zeros.data());
+        }
+    }
+    H5Dclose(dst);
+    H5Sclose(space);
+    H5Pclose(dcpl);
+    H5Tclose(type);
+    H5Dclose(src);
+}
+
+static herr_t generate_group_cb(hid_t src_group, const char* name, const H5L_info_t*, void* op_data);
+
+static void generate_group(hid_t src_group, hid_t dst_group, TableRows& rows) {
+    std::pair<hid_t, TableRows*> args(dst_group, &rows);
+    H5Literate(src_group, H5_INDEX_NAME, H5_ITER_NATIVE, nullptr, &generate_group_cb, &args);
+}
+
+static herr_t generate_group_cb(hid_t src_group, const char* name, const H5L_info_t*, void* op_data) {
+    auto args = static_cast<std::pair<hid_t, TableRows*>*>(op_data);
+    H5O_type_t obj_type = HDF5Compat::object_type(src_group, name);
+    if(obj_type == H5O_TYPE_GROUP) {
+        hid_t src = H5Gopen(src_group, name, H5P_DEFAULT);
+        hid_t dst = H5Gcreate(args->first, name, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        generate_group(src, dst, *args->second);
+        H5Gclose(dst);
+        H5Gclose(src);
+    } else if(obj_type == H5O_TYPE_DATASET) {
+        generate_dataset(src_group, args->first, name, *args->second);
+    }
+    return 0;
+}
+
+static void generate_file(hid_t template_file, const std::vector<std::string>& tables,
+                          const std::string& filename, int run, int subrun, unsigned seed) {
+    std::mt19937 rng(seed);
+    hid_t file = H5Fcreate(filename.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    if(file < 0) {
+        spdlog::critical("Could not create file {}", filename);
+        exit(1);
+    }
+    // Each event has between 1 and 2*rows_per_event-1 rows in each table
+    std::uniform_int_distribution<int> rows_dist(1, 2*g_rows_per_event-1);
+    for(auto& table : tables) {
+        TableRows rows;
+        rows.rng = &rng;
+        for(int e = 0; e < g_events; e++) {
+            int n = rows_dist(rng);
+            for(int i = 0; i < n; i++) {
+                rows.run.push_back(run);
+                rows.subrun.push_back(subrun);
+                rows.evt.push_back(e);
+                rows.subevt.push_back(i);
+            }
+        }
+        hid_t src = H5Gopen(template_file, table.c_str(), H5P_DEFAULT);
+        hid_t lcpl = H5Pcreate(H5P_LINK_CREATE);
+        H5Pset_create_intermediate_group(lcpl, 1);
+        hid_t dst = H5Gcreate(file, table.c_str(), lcpl, H5P_DEFAULT, H5P_DEFAULT);
+        H5Pclose(lcpl);
+        generate_group(src, dst, rows);
+        H5Gclose(dst);
+        H5Gclose(src);
+    }
+    H5Fclose(file);
+}
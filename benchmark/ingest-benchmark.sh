@@ -0,0 +1,105 @@
+#!/bin/bash
+# Generates synthetic NOvA files and measures the ingest rate of the
+# dataloader against a local HEPnOS daemon, first in --simulate mode
+# (HDF5 reads only), then storing the data, and finally the rate at
+# which the stored data is read back with --verify, which also checks
+# that every event and product arrived. Results are appended to
+# ${RESULTS} as CSV so that successive runs can be compared. Byte
+# counts and MB/s are those of the input files on disk (as listed by
+# the generator), not of the data serialized into HEPnOS.
+#
+# Usage: ingest-benchmark.sh <build directory> [<template .h5caf.h5 file>]
+#
+# The template file, whose table layout is cloned into the synthetic
+# files, can also be given in the TEMPLATE environment variable.
+# The following environment variables can be set:
+#   FILES, EVENTS, ROWS_PER_EVENT  size of the synthetic dataset
+#   NPROCS                         number of dataloader processes
+#   PROTOCOL                       Mercury protocol (default na+sm)
+#   BATCH_SIZE                     WriteBatch size
+#   LOADER_ARGS                    additional dataloader arguments
+#   WORKDIR                        where files are generated
+#   RESULTS                        CSV file receiving the results
+
+set -eu
+
+BUILD_DIR=${1:?"Usage: $0 <build directory> <template file>"}
+TEMPLATE=${2:-${TEMPLATE:?"Usage: $0 <build directory> <template file>"}}
+HERE=$(cd "$(dirname "$0")" && pwd)
+
+FILES=${FILES:-16}
+EVENTS=${EVENTS:-1000}
+ROWS_PER_EVENT=${ROWS_PER_EVENT:-2}
+NPROCS=${NPROCS:-4}
+PROTOCOL=${PROTOCOL:-na+sm}
+BATCH_SIZE=${BATCH_SIZE:-1024}
+LOADER_ARGS=${LOADER_ARGS:-}
+WORKDIR=${WORKDIR:-$(pwd)/ingest-benchmark}
+RESULTS=${RESULTS:-$(pwd)/ingest-benchmark.csv}
+
+CONNECTIONFILE=${WORKDIR}/connection.yaml
+INPUTFILE=${WORKDIR}/datafiles.txt
+
+mkdir -p ${WORKDIR}
+rm -f ${CONNECTIONFILE}
+
+echo "Generating ${FILES} synthetic files"
+SUMMARY=$(${BUILD_DIR}/hepnos-dataloader-synthetic -t ${TEMPLATE} -d ${WORKDIR} -o ${INPUTFILE} \
+          -f ${FILES} -e ${EVENTS} -r ${ROWS_PER_EVENT} | grep "^FILES:")
+NUM_EVENTS=$(echo ${SUMMARY} | awk '{ print $4 }')
+NUM_BYTES=$(echo ${SUMMARY} | awk '{ print $6 }') # size of the input files
+
+echo "Starting up HEPnOS daemon"
+hepnos-daemon ${HERE}/config.yaml ${CONNECTIONFILE} &
+DAEMON_PID=$!
+trap "kill ${DAEMON_PID} 2> /dev/null || true" EXIT
+while [ ! -f ${CONNECTIONFILE} ]; do sleep 1; done
+
+if [ ! -f ${RESULTS} ]; then
+    echo "date,revision,mode,processes,files,events,input_bytes,time,files_per_sec,events_per_sec,input_mb_per_sec" > ${RESULTS}
+fi
+REVISION=$(git -C ${HERE} rev-parse --short HEAD 2> /dev/null || echo unknown)
+
+run_loader() {
+    local mode=$1
+    shift
+    echo "Running dataloader (${mode})"
+    local output=$(mpirun -n ${NPROCS} ${BUILD_DIR}/hepnos-dataloader \
+                   -p ${PROTOCOL} -c ${CONNECTIONFILE} -i ${INPUTFILE} \
+                   -o Benchmark -l synthetic -b ${BATCH_SIZE} ${LOADER_ARGS} "$@" | grep "^TIME:")
+    # TIME: <seconds> FILES: <processed>/<total>
+    local time=$(echo ${output} | awk '{ print $2 }')
+    local processed=$(echo ${output} | awk '{ split($4, a, "/"); print a[1] }')
+    awk -v date="$(date +%Y-%m-%dT%H:%M:%S)" -v rev=${REVISION} -v mode=${mode} -v np=${NPROCS} \
+        -v files=${processed} -v total=${FILES} -v events=${NUM_EVENTS} -v bytes=${NUM_BYTES} -v t=${time} \
+        'BEGIN {
+            e = events*files/total; b = bytes*files/total;
+            printf "%s,%s,%s,%d,%d,%d,%d,%f,%f,%f,%f\n", date, rev, mode, np, files, e, b, t,
+                   files/t, e/t, b/1e6/t
+        }' | tee -a ${RESULTS}
+}
+
+run_verify() {
+    echo "Reading back and verifying the dataset"
+    local output=$(mpirun -n ${NPROCS} ${BUILD_DIR}/hepnos-dataloader \
+                   -p ${PROTOCOL} -c ${CONNECTIONFILE} -i ${INPUTFILE} \
+                   -o Benchmark -l synthetic -b ${BATCH_SIZE} ${LOADER_ARGS} --verify | grep "^VERIFY:\|^READ TIME:")
+    echo "${output}" | grep "^VERIFY:"
+    # READ TIME: <seconds> EVENTS/S: <events per sec> ROW MB/S: <MB of decoded rows per sec>
+    local time=$(echo "${output}" | grep "^READ TIME:" | awk '{ print $3 }')
+    awk -v date="$(date +%Y-%m-%dT%H:%M:%S)" -v rev=${REVISION} -v np=${NPROCS} \
+        -v files=${FILES} -v events=${NUM_EVENTS} -v bytes=${NUM_BYTES} -v t=${time} \
+        'BEGIN {
+            printf "%s,%s,read,%d,%d,%d,%d,%f,%f,%f,%f\n", date, rev, np, files, events, bytes, t,
+                   files/t, events/t, bytes/1e6/t
+        }' | tee -a ${RESULTS}
+}
+
+run_loader simulate -s
+run_loader store
+run_verify
+
+echo "Shutting down HEPnOS"
+hepnos-shutdown ${CONNECTIONFILE}
+wait ${DAEMON_PID} || true
+trap - EXIT
@@ -0,0 +1,51 @@
+#!/bin/bash
+# Measures the work queues over a sweep of numbers of processes, with
+# oversubscription so that it can run on a single node. Results are
+# appended to ${RESULTS} as CSV so that successive runs can be compared.
+#
+# Usage: queue-benchmark.sh <build directory>
+#
+# The following environment variables can be set:
+#   RANKS        numbers of processes to run with (default "2 4 8 16 32")
+#   QUEUES       queue implementations (default "centralized distributed")
+#   ITEMS        number of work items
+#   ITEM_SIZE    size of each work item in bytes
+#   WORK_TIME    processing time of each item in microseconds
+#   QUEUE_ARGS   additional benchmark arguments (e.g. --bulk 8)
+#   RESULTS      CSV file receiving the results
+
+set -eu
+
+BUILD_DIR=${1:?"Usage: $0 <build directory>"}
+HERE=$(cd "$(dirname "$0")" && pwd)
+
+RANKS=${RANKS:-"2 4 8 16 32"}
+QUEUES=${QUEUES:-"centralized distributed"}
+ITEMS=${ITEMS:-10000}
+ITEM_SIZE=${ITEM_SIZE:-128}
+WORK_TIME=${WORK_TIME:-100}
+QUEUE_ARGS=${QUEUE_ARGS:-}
+RESULTS=${RESULTS:-$(pwd)/queue-benchmark.csv}
+
+if [ ! -f ${RESULTS} ]; then
+    echo "date,revision,queue,processes,items,item_size,work_time,push_items_per_sec,pull_items_per_sec,p50_us,p90_us,p99_us,max_us,shutdown_sec" > ${RESULTS}
+fi
+REVISION=$(git -C ${HERE} rev-parse --short HEAD 2> /dev/null || echo unknown)
+
+for queue in ${QUEUES}; do
+    for np in ${RANKS}; do
+        echo "Running ${queue} queue with ${np} processes"
+        output=$(mpirun --oversubscribe -n ${np} ${BUILD_DIR}/hepnos-dataloader-queue-benchmark \
+                 --queue ${queue} -n ${ITEMS} -s ${ITEM_SIZE} -w ${WORK_TIME} ${QUEUE_ARGS})
+        # PUSH: <rate> ITEMS/S
+        # PULL: <rate> ITEMS/S IN <seconds> S
+        # LATENCY (us): P50 <p50> P90 <p90> P99 <p99> MAX <max>
+        # SHUTDOWN: <seconds> S
+        push=$(echo "${output}" | grep "^PUSH:" | awk '{ print $2 }')
+        pull=$(echo "${output}" | grep "^PULL:" | awk '{ print $2 }')
+        latency=$(echo "${output}" | grep "^LATENCY" | awk '{ print $4","$6","$8","$10 }')
+        shutdown=$(echo "${output}" | grep "^SHUTDOWN:" | awk '{ print $2 }')
+        echo "$(date +%Y-%m-%dT%H:%M:%S),${REVISION},${queue},${np},${ITEMS},${ITEM_SIZE},${WORK_TIME},${push},${pull},${latency},${shutdown}" \
+            | tee -a ${RESULTS}
+    done
+done
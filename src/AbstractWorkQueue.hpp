@@ -0,0 +1,77 @@
+#ifndef __DATALOADER_ABSTRACT_WORK_QUEUE_H
+#define __DATALOADER_ABSTRACT_WORK_QUEUE_H
+
+#include <string>
+#include <vector>
+#include <exception>
+#include <cstdint>
+
+/**
+ * Interface shared by all the work queue implementations.
+ * Work is pushed while the queue is open for writes, the queue is
+ * then made read-only by all the processes, and work is pulled until
+ * an EmptyQueueException is thrown.
+ */
+class AbstractWorkQueue {
+
+    public:
+
+    class EmptyQueueException : public std::exception {
+
+        public:
+
+        const char* what() const noexcept {
+            return "Work queue is empty";
+        }
+    };
+
+    class ReadOnlyQueueException : public std::exception {
+
+        public:
+
+        const char* what() const noexcept {
+            return "Work queue is read-only";
+        }
+    };
+
+    enum SchedulingPolicy {
+        FIFO,           // work is pulled in the order it was pushed
+        LONGEST_FIRST   // work with the largest cost is pulled first (LPT)
+    };
+
+    virtual ~AbstractWorkQueue() = default;
+
+    virtual void start_listening() = 0;
+
+    virtual void readonly() = 0;
+
+    virtual void push(const std::string& work, uint64_t cost = 0) = 0;
+
+    virtual std::string pull() = 0;
+
+    /**
+     * Pulls up to max_items work items at once. Blocks until at least
+     * one item is available, throws EmptyQueueException if there are none.
+     * The default implementation pulls a single item.
+     */
+    virtual std::vector<std::string> pull_bulk(size_t max_items) {
+        std::vector<std::string> result;
+        if(max_items > 0) result.push_back(pull());
+        return result;
+    }
+
+    /**
+     * Returns work items that were pulled but not processed, so that
+     * other processes can pull them. Returns false if the implementation
+     * does not support giving work back, in which case the caller
+     * remains responsible for the items.
+     */
+    virtual bool give_back(const std::vector<std::string>& work) {
+        (void)work;
+        return false;
+    }
+
+    virtual void clear() = 0;
+};
+
+#endif
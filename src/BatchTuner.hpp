@@ -0,0 +1,61 @@
+#ifndef __DATALOADER_BATCH_TUNER_H
+#define __DATALOADER_BATCH_TUNER_H
+
+#include <cmath>
+#include <algorithm>
+
+/**
+ * The BatchTuner chooses the size of a WriteBatch so that the time it
+ * takes to fill and flush one batch approaches a target latency. After
+ * each flush, it is given the number of items stored since the previous
+ * one and the time spent storing and flushing them, from which it keeps
+ * a moving average of the cost of an item. The size it proposes is the
+ * number of items that can be stored within the target latency, changing
+ * by at most a factor 2 per update to avoid oscillations.
+ */
+class BatchTuner {
+
+    public:
+
+    static constexpr size_t MIN_BATCH_SIZE = 8;
+    static constexpr size_t MAX_BATCH_SIZE = 65536;
+
+    BatchTuner(double target_latency = 0.0)
+    : m_target_latency(target_latency) {}
+
+    bool enabled() const {
+        return m_target_latency > 0.0;
+    }
+
+    /**
+     * Returns the batch size to use from now on, given the current one,
+     * the number of items stored and flushed, and the time (seconds) it
+     * took to store and flush them.
+     */
+    size_t update(size_t current_size, size_t num_items, double seconds) {
+        if(!enabled() || num_items == 0 || seconds <= 0.0) return current_size;
+        double item_cost = seconds / num_items;
+        if(m_item_cost == 0.0) m_item_cost = item_cost;
+        else m_item_cost = ALPHA * item_cost + (1.0 - ALPHA) * m_item_cost;
+        double ideal = m_target_latency / m_item_cost;
+        double lower = std::max<double>(MIN_BATCH_SIZE, current_size / 2.0);
+        double upper = std::min<double>(MAX_BATCH_SIZE, current_size * 2.0);
+        return (size_t)std::round(std::min(upper, std::max(lower, ideal)));
+    }
+
+    /**
+     * Moving average of the time (seconds) needed to store and flush one item.
+     */
+    double item_cost() const {
+        return m_item_cost;
+    }
+
+    private:
+
+    static constexpr double ALPHA = 0.5; // weight of the last measurement
+
+    double m_target_latency; // seconds to fill and flush a batch
+    double m_item_cost = 0.0; // moving average of the cost of an item
+};
+
+#endif
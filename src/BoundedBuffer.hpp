@@ -0,0 +1,66 @@
+#ifndef __DATALOADER_BOUNDED_BUFFER_H
+#define __DATALOADER_BOUNDED_BUFFER_H
+
+#include <deque>
+#include <mutex>
+#include <thallium.hpp>
+
+namespace tl = thallium;
+
+/**
+ * Producer/consumer buffer holding at most "capacity" items.
+ * push() blocks while the buffer is full, pop() blocks while it is
+ * empty. Once close() has been called, pop() returns false when
+ * the buffer has been drained.
+ */
+template<typename T>
+class BoundedBuffer {
+
+    public:
+
+    BoundedBuffer(size_t capacity)
+    : m_capacity(capacity > 0 ? capacity : 1) {}
+
+    void push(T item) {
+        {
+            std::unique_lock<tl::mutex> lock(m_mtx);
+            while(m_items.size() >= m_capacity) {
+                m_cv.wait(lock);
+            }
+            m_items.push_back(std::move(item));
+        }
+        m_cv.notify_all();
+    }
+
+    bool pop(T& item) {
+        {
+            std::unique_lock<tl::mutex> lock(m_mtx);
+            while(m_items.empty() && !m_closed) {
+                m_cv.wait(lock);
+            }
+            if(m_items.empty()) return false;
+            item = std::move(m_items.front());
+            m_items.pop_front();
+        }
+        m_cv.notify_all();
+        return true;
+    }
+
+    void close() {
+        {
+            std::unique_lock<tl::mutex> lock(m_mtx);
+            m_closed = true;
+        }
+        m_cv.notify_all();
+    }
+
+    private:
+
+    size_t                 m_capacity; // maximum number of items
+    std::deque<T>          m_items; // items in the buffer
+    bool                   m_closed = false; // no more items will be pushed
+    tl::mutex              m_mtx; // protects the above
+    tl::condition_variable m_cv; // notified when items are pushed or popped
+};
+
+#endif
@@ -0,0 +1,136 @@
+#ifndef __DATALOADER_BUFFER_POOL_H
+#define __DATALOADER_BUFFER_POOL_H
+
+#include <vector>
+#include <mutex>
+#include <string>
+#include <map>
+#include <thallium.hpp>
+
+namespace tl = thallium;
+
+/**
+ * Statistics and settings common to all the BufferPools, so that
+ * they can be listed and reported without knowing their types.
+ */
+class BufferPoolBase {
+
+    public:
+
+    struct Statistics {
+        uint64_t acquired = 0; // number of buffers acquired
+        uint64_t reused   = 0; // number of buffers acquired from the pool
+        uint64_t max_bytes = 0; // largest capacity of a released buffer
+    };
+
+    virtual ~BufferPoolBase() = default;
+
+    virtual std::string name() const = 0;
+
+    virtual Statistics statistics() const = 0;
+
+    /**
+     * Sets how many unused buffers each pool may keep.
+     * Buffers released when the pool is full are freed.
+     */
+    static void set_max_free(size_t max_free) {
+        _max_free() = max_free;
+    }
+
+    /**
+     * Lists all the pools that were used.
+     */
+    static std::vector<BufferPoolBase*> pools() {
+        std::unique_lock<tl::mutex> lock(_registry_mtx());
+        return _registry();
+    }
+
+    protected:
+
+    static size_t& _max_free() {
+        static size_t max_free = 1;
+        return max_free;
+    }
+
+    static void _register(BufferPoolBase* pool) {
+        std::unique_lock<tl::mutex> lock(_registry_mtx());
+        _registry().push_back(pool);
+    }
+
+    private:
+
+    static std::vector<BufferPoolBase*>& _registry() {
+        static std::vector<BufferPoolBase*> registry;
+        return registry;
+    }
+
+    static tl::mutex& _registry_mtx() {
+        static tl::mutex mtx;
+        return mtx;
+    }
+};
+
+/**
+ * Pool of vectors of T, shared by all the workers of a process. Released
+ * vectors are cleared but keep their capacity, so that acquiring one does
+ * not allocate memory unless it needs to grow beyond the largest size it
+ * had so far.
+ */
+template<typename T>
+class BufferPool : public BufferPoolBase {
+
+    public:
+
+    /**
+     * Returns the pool of vectors of T with the given name, creating it
+     * on first use. Pools are never destroyed.
+     */
+    static BufferPool& instance(const std::string& name) {
+        static std::map<std::string, BufferPool*> pools;
+        static tl::mutex mtx;
+        std::unique_lock<tl::mutex> lock(mtx);
+        auto& pool = pools[name];
+        if(!pool) pool = new BufferPool(name);
+        return *pool;
+    }
+
+    std::vector<T> acquire() {
+        std::unique_lock<tl::mutex> lock(m_mtx);
+        m_stats.acquired += 1;
+        if(m_free.empty()) return std::vector<T>();
+        m_stats.reused += 1;
+        std::vector<T> buffer = std::move(m_free.back());
+        m_free.pop_back();
+        return buffer;
+    }
+
+    void release(std::vector<T>&& buffer) {
+        buffer.clear();
+        std::unique_lock<tl::mutex> lock(m_mtx);
+        m_stats.max_bytes = std::max<uint64_t>(m_stats.max_bytes, buffer.capacity()*sizeof(T));
+        if(m_free.size() < _max_free()) m_free.push_back(std::move(buffer));
+    }
+
+    std::string name() const override {
+        return m_name;
+    }
+
+    Statistics statistics() const override {
+        std::unique_lock<tl::mutex> lock(m_mtx);
+        return m_stats;
+    }
+
+    private:
+
+    BufferPool(const std::string& name)
+    : m_name(name) {
+        _register(this);
+    }
+
+    std::string                 m_name; // name used in reports
+    std::vector<std::vector<T>> m_free; // unused buffers
+    Statistics                  m_stats; // usage statistics
+    mutable tl::mutex           m_mtx; // protects the above
+};
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef __DATALOADER_BULK_PRODUCT_H
+#define __DATALOADER_BULK_PRODUCT_H
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <boost/serialization/vector.hpp>
+
+/**
+ * All the rows of a table for a subrun, stored as a single product of
+ * the SubRun with --bulk instead of one product per event. The rows are
+ * kept in event order, and the index (event numbers and offsets) gives
+ * the range of rows of each event so that an event's rows can still be
+ * retrieved without decoding anything else than this product.
+ */
+template<typename T>
+struct BulkProduct {
+
+    std::vector<uint64_t> events; // sorted event numbers
+    std::vector<uint64_t> offsets; // rows of events[i] are [offsets[i], offsets[i+1])
+    std::vector<T>        rows; // rows of all the events
+
+    /**
+     * Finds the range of rows of an event.
+     * Returns false if the event has no rows.
+     */
+    bool find(uint64_t event, size_t& begin, size_t& end) const {
+        auto it = std::lower_bound(events.begin(), events.end(), event);
+        if(it == events.end() || *it != event) return false;
+        size_t i = it - events.begin();
+        begin = offsets[i];
+        end   = offsets[i+1];
+        return true;
+    }
+
+    /**
+     * Returns the rows of an event (empty if it has none).
+     */
+    std::vector<T> rows_of(uint64_t event) const {
+        size_t begin, end;
+        if(!find(event, begin, end)) return std::vector<T>();
+        return std::vector<T>(rows.begin() + begin, rows.begin() + end);
+    }
+
+    template<typename Archive>
+    void serialize(Archive& ar, const unsigned int) {
+        ar & events;
+        ar & offsets;
+        ar & rows;
+    }
+};
+
+#endif
@@ -0,0 +1,202 @@
+#ifndef __DATALOADER_COMPRESSION_H
+#define __DATALOADER_COMPRESSION_H
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <zlib.h>
+#ifdef DATALOADER_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef DATALOADER_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include <boost/archive/binary_oarchive.hpp>
+#include <boost/archive/binary_iarchive.hpp>
+#include <boost/serialization/string.hpp>
+
+/**
+ * Compression codecs that can be applied to serialized products.
+ * zlib is always available, LZ4 and zstd only if the loader was
+ * built with them.
+ */
+class Compressor {
+
+    public:
+
+    enum Codec : uint8_t {
+        NONE = 0,
+        ZLIB = 1,
+        LZ4  = 2,
+        ZSTD = 3
+    };
+
+    static bool from_string(const std::string& name, Codec& codec) {
+        if(name == "none")      codec = NONE;
+        else if(name == "zlib") codec = ZLIB;
+        else if(name == "lz4")  codec = LZ4;
+        else if(name == "zstd") codec = ZSTD;
+        else return false;
+        return true;
+    }
+
+    static const char* to_string(Codec codec) {
+        switch(codec) {
+            case ZLIB: return "zlib";
+            case LZ4:  return "lz4";
+            case ZSTD: return "zstd";
+            default:   return "none";
+        }
+    }
+
+    static bool available(Codec codec) {
+        switch(codec) {
+            case NONE:
+            case ZLIB: return true;
+#ifdef DATALOADER_HAVE_LZ4
+            case LZ4:  return true;
+#endif
+#ifdef DATALOADER_HAVE_ZSTD
+            case ZSTD: return true;
+#endif
+            default:   return false;
+        }
+    }
+
+    /**
+     * Compresses size bytes of data into out. A level of 0 selects the
+     * codec's default (for LZ4, the level is the acceleration factor).
+     * Returns false if the codec is unavailable or compression failed.
+     */
+    static bool compress(Codec codec, int level, const char* data, size_t size, std::string& out) {
+        switch(codec) {
+            case NONE:
+                out.assign(data, size);
+                return true;
+            case ZLIB: {
+                uLongf out_size = compressBound(size);
+                out.resize(out_size);
+                int ret = compress2(reinterpret_cast<Bytef*>(&out[0]), &out_size,
+                                    reinterpret_cast<const Bytef*>(data), size,
+                                    level ? level : Z_DEFAULT_COMPRESSION);
+                if(ret != Z_OK) return false;
+                out.resize(out_size);
+                return true;
+            }
+#ifdef DATALOADER_HAVE_LZ4
+            case LZ4: {
+                out.resize(LZ4_compressBound(size));
+                int out_size = LZ4_compress_fast(data, &out[0], size, out.size(), level ? level : 1);
+                if(out_size <= 0) return false;
+                out.resize(out_size);
+                return true;
+            }
+#endif
+#ifdef DATALOADER_HAVE_ZSTD
+            case ZSTD: {
+                out.resize(ZSTD_compressBound(size));
+                size_t out_size = ZSTD_compress(&out[0], out.size(), data, size,
+                                                level ? level : ZSTD_CLEVEL_DEFAULT);
+                if(ZSTD_isError(out_size)) return false;
+                out.resize(out_size);
+                return true;
+            }
+#endif
+            default:
+                return false;
+        }
+    }
+
+    /**
+     * Decompresses data into out, which must have the original size.
+     */
+    static bool decompress(Codec codec, const std::string& data, std::string& out) {
+        switch(codec) {
+            case NONE:
+                if(data.size() != out.size()) return false;
+                out = data;
+                return true;
+            case ZLIB: {
+                uLongf out_size = out.size();
+                int ret = uncompress(reinterpret_cast<Bytef*>(&out[0]), &out_size,
+                                     reinterpret_cast<const Bytef*>(data.data()), data.size());
+                return ret == Z_OK && out_size == out.size();
+            }
+#ifdef DATALOADER_HAVE_LZ4
+            case LZ4: {
+                int out_size = LZ4_decompress_safe(data.data(), &out[0], data.size(), out.size());
+                return out_size == (int)out.size();
+            }
+#endif
+#ifdef DATALOADER_HAVE_ZSTD
+            case ZSTD: {
+                size_t out_size = ZSTD_decompress(&out[0], out.size(), data.data(), data.size());
+                return !ZSTD_isError(out_size) && out_size == out.size();
+            }
+#endif
+            default:
+                return false;
+        }
+    }
+};
+
+/**
+ * Product stored instead of a std::vector<T> when compression is enabled
+ * for T. Its type name, which is part of the product's key in HEPnOS, is
+ * the marker readers can look for, and the magic number lets them check
+ * a value. The payload is the Boost binary archive (without header) of
+ * the number of rows followed by the rows, compressed with the codec.
+ */
+template<typename T>
+struct CompressedProduct {
+
+    static constexpr uint32_t MAGIC = 0x4850435a; // "HPCZ"
+
+    uint32_t    magic = MAGIC;
+    uint8_t     codec = Compressor::NONE;
+    uint64_t    original_size = 0; // size of the uncompressed payload
+    std::string data; // compressed payload
+
+    /**
+     * Compresses a payload (see above). If the codec fails,
+     * the payload is kept uncompressed (with codec NONE).
+     */
+    void compress(Compressor::Codec c, int level, const std::string& payload) {
+        original_size = payload.size();
+        codec = c;
+        if(!Compressor::compress(c, level, payload.data(), payload.size(), data)) {
+            codec = Compressor::NONE;
+            data = payload;
+        }
+    }
+
+    /**
+     * Decompresses and deserializes the rows. Returns false
+     * if the value is not valid or cannot be decompressed.
+     */
+    bool decompress(std::vector<T>& rows) const {
+        if(magic != MAGIC) return false;
+        std::string payload(original_size, '\0');
+        if(!Compressor::decompress((Compressor::Codec)codec, data, payload)) return false;
+        std::stringstream ss(payload);
+        boost::archive::binary_iarchive ia(ss, boost::archive::no_header);
+        size_t count;
+        ia >> count;
+        rows.resize(count);
+        for(auto& row : rows) ia >> row;
+        return true;
+    }
+
+    template<typename Archive>
+    void serialize(Archive& ar, const unsigned int) {
+        ar & magic;
+        ar & codec;
+        ar & original_size;
+        ar & data;
+    }
+};
+
+template<typename T>
+constexpr uint32_t CompressedProduct<T>::MAGIC;
+
+#endif
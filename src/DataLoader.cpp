@@ -2,9 +2,23 @@
 #include <iostream>
 #include <sstream>
 #include <regex>
+#include <set>
+#include <map>
 #include <fstream>
 #include <string>
 #include <unordered_map>
+#include <memory>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <climits>
+#include <algorithm>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <spdlog/spdlog.h>
 #include <spdlog/fmt/ostr.h>
 #include <tclap/CmdLine.h>
@@ -20,6 +34,19 @@
 #endif
 
 #include "WorkQueue.hpp"
+#include "DistributedWorkQueue.hpp"
+#include "PrefetchingWorkQueue.hpp"
+#include "Manifest.hpp"
+#include "WorkUnit.hpp"
+#include "BoundedBuffer.hpp"
+#include "EventIndex.hpp"
+#include "TableSlicer.hpp"
+#include "Journal.hpp"
+#include "Profiler.hpp"
+#include "OutputSink.hpp"
+#include "BufferPool.hpp"
+#include "SubRunCache.hpp"
+#include "MemoryBudget.hpp"
 
 static int         g_rank;              // Rank of this process
 static int         g_size;              // Size of MPI_COMM_WORKD
@@ -38,35 +65,240 @@ static spdlog::level::level_enum g_logging_level; // Logging level
 static std::vector<std::string>  g_product_names; // Product names
 static int         g_timeout;           // Timeout
 static hepnos::RunNumber g_run_offset;  // Offset to add to all event numbers when storing
+static WorkQueue::SchedulingPolicy g_scheduling; // Order in which files are handed out
+static bool        g_distributed_queue; // Use the DistributedWorkQueue instead of WorkQueue
+static int         g_lookahead;         // Number of files to keep reserved ahead of the current one
+static int         g_num_workers;       // Number of files processed concurrently by each rank
+static bool        g_split_products;    // Distribute (file, product) work units instead of files
+static uint64_t    g_rows_per_unit;     // Maximum number of rows of a table per work unit (0 for no limit)
+static bool        g_pipeline;          // Overlap reading and writing in separate stages
+static int         g_pipeline_depth;    // Number of decoded tables buffered between the stages
+static bool        g_streaming;         // Read tables in chunks of rows instead of entirely
+static size_t      g_memory_limit;      // Memory (bytes) each process may use for decoded rows with --streaming
+static std::string g_manifest_file;     // File caching sizes and row counts of input files
+static std::string g_journal_file;      // Prefix of the files recording the completed work units
+static bool        g_resume;            // Skip the work units recorded in the journal
+static std::string g_report_file;       // File in which to write the per-phase timing report
+static std::string g_sink_type;         // Where products go: hepnos, discard or file
+static std::string g_sink_file;         // Prefix of the files written by the file sink
+static double      g_auto_batch_latency; // Target latency (sec) of a WriteBatch when tuning batch sizes
+static std::unordered_map<std::string, size_t> g_product_batch_sizes; // Batch size of each product
+static bool        g_reuse_buffers;     // Decode tables into buffers reused across files
+static uint64_t    g_collective_threshold; // Size (bytes) from which files are read collectively (0 to disable)
+static int         g_collective_group;  // Number of processes reading a large file together
+static int         g_flush_every;       // Number of work units to complete between flushes
+static std::unordered_map<std::string, std::pair<Compressor::Codec, int>> g_product_compression; // Codec and level of each product
+static bool        g_bulk;              // Store each table as one product of its subrun instead of one per event
+static bool        g_raw_layout;        // Store trivially copyable products as raw rows with a header
+static bool        g_verify;            // Read the output dataset back and compare it with the input files
+static uint64_t    g_memory_image_threshold; // Size (bytes) up to which files are read entirely into memory (0 to disable)
+static std::unordered_map<std::string, uint64_t> g_file_sizes; // Size of the input files, from the manifest
+static size_t      g_memory_budget_size; // Memory (bytes) each process may hold in decoded tables and unflushed data (0 for no limit)
 
-static uint64_t g_total_events = 0;
-static uint64_t g_total_products = 0;
+static std::atomic<uint64_t> g_total_events{0};
+static std::atomic<uint64_t> g_total_products{0};
+static Profiler g_profiler; // Time spent in each phase, per product
+static std::atomic<uint64_t> g_num_allocations{0}; // Calls to operator new (with DATALOADER_COUNT_ALLOCATIONS)
+static MemoryBudget g_memory_budget; // Bytes held in decoded tables and unflushed data
+
+static tl::mutex g_hdf5_mtx; // Serializes HDF5 calls if the library is not thread-safe
+static std::unique_lock<tl::mutex> lock_hdf5();
+
+#ifdef DATALOADER_COUNT_ALLOCATIONS
+/**
+ * Replacing the global operator new lets us count the allocations made
+ * by the whole process, to compare runs with and without --no-buffer-reuse.
+ * Array forms and the nothrow forms default to these. Only built with
+ * -DCOUNT_ALLOCATIONS=ON, since it adds an atomic to every allocation.
+ */
+void* operator new(size_t size) {
+    g_num_allocations.fetch_add(1, std::memory_order_relaxed);
+    if(void* ptr = std::malloc(size ? size : 1)) return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    std::free(ptr);
+}
+#endif
+
+/**
+ * Rows of a product table read from an HDF5 file, ready to be stored.
+ */
+class DecodedTable {
+
+    public:
+
+    virtual ~DecodedTable() = default;
+
+    virtual void store(OutputSink& sink) = 0;
+
+    /**
+     * Size of the rows to store, which is also how much data
+     * store() adds to the WriteBatches of the sink.
+     */
+    virtual size_t num_bytes() const = 0;
+};
+
+/**
+ * Function called on each table (or chunk of a table with --streaming)
+ * read from an HDF5 file.
+ */
+typedef std::function<void(std::unique_ptr<DecodedTable>)> TableConsumer;
+
+/**
+ * Item passed from the reader to the writer stage when using --pipeline:
+ * either a table (or chunk of a table) of a work unit, or, if table is
+ * null, the marker indicating that all the tables of the unit were read,
+ * or, if drain is set, a request to drain the sink because the reader
+ * waits for memory to be released.
+ */
+struct PipelineItem {
+    WorkUnit                      unit;
+    std::unique_ptr<DecodedTable> table;
+    bool                          drain = false;
+};
+
+/**
+ * Time spent in each stage of the pipeline (--pipeline).
+ * Only contains doubles so that it can be reduced with MPI_DOUBLE.
+ */
+struct PipelineStatistics {
+    double reader_busy  = 0.0; // time spent reading HDF5 files
+    double reader_wait  = 0.0; // time spent waiting for room in the buffer
+    double reader_total = 0.0; // lifetime of the reader stage
+    double writer_busy  = 0.0; // time spent storing products
+    double writer_wait  = 0.0; // time spent waiting for decoded tables
+    double writer_total = 0.0; // lifetime of the writer stage
+
+    PipelineStatistics& operator+=(const PipelineStatistics& other) {
+        reader_busy  += other.reader_busy;
+        reader_wait  += other.reader_wait;
+        reader_total += other.reader_total;
+        writer_busy  += other.writer_busy;
+        writer_wait  += other.writer_wait;
+        writer_total += other.writer_total;
+        return *this;
+    }
+};
+
+/**
+ * Read system calls, bytes read and time spent reading the input files,
+ * excluding the time spent storing their tables. Kept separately for the
+ * files opened from a memory image (--memory-image-threshold) and for the
+ * others, to compare both. Calls and bytes are read from /proc/self/io,
+ * which counts for the whole process: they are exact per file only with
+ * --simulate, a single worker and no --lookahead.
+ * Only contains doubles so that it can be reduced with MPI_DOUBLE.
+ */
+struct FileIOStatistics {
+    double files      = 0.0; // number of files read
+    double read_calls = 0.0; // read system calls
+    double read_bytes = 0.0; // bytes returned by read system calls
+    double time       = 0.0; // time spent opening, reading and closing files
+
+    /**
+     * Fills read_calls and read_bytes with the counters of the process.
+     */
+    static FileIOStatistics now() {
+        FileIOStatistics stats;
+        int fd = open("/proc/self/io", O_RDONLY);
+        if(fd < 0) return stats;
+        char buffer[512];
+        ssize_t size = read(fd, buffer, sizeof(buffer)-1);
+        close(fd);
+        if(size <= 0) return stats;
+        buffer[size] = '\0';
+        unsigned long long rchar = 0, syscr = 0;
+        const char* p;
+        if((p = strstr(buffer, "rchar:"))) sscanf(p, "rchar: %llu", &rchar);
+        if((p = strstr(buffer, "syscr:"))) sscanf(p, "syscr: %llu", &syscr);
+        stats.read_calls = syscr;
+        stats.read_bytes = rchar;
+        return stats;
+    }
+};
+
+static FileIOStatistics g_file_io_stats[2]; // files read directly [0] and from a memory image [1]
+static tl::mutex g_file_io_stats_mtx; // protects g_file_io_stats
 
 static std::unordered_map<std::string,
-    std::function<void(hepnos::SubRun&,
-                       std::unordered_map<hepnos::EventNumber,hepnos::Event>&,
-                       hid_t, hepnos::WriteBatch&)>
+    std::function<void(hid_t, const std::string&, uint64_t, uint64_t, const TableConsumer&)>
     > g_load_product_fn;
-static void process_table(hepnos::SubRun& sr,
-       std::unordered_map<hepnos::EventNumber,hepnos::Event>& createdEvents,
-       hid_t hdf_file, hepnos::WriteBatch& wb);
+
+static std::unordered_map<std::string,
+    std::function<void(hid_t, const std::string&, MPI_Comm, hid_t, const TableConsumer&)>
+    > g_load_product_share_fn;
+
+/**
+ * Functions reading back the products of a type with --verify: preload
+ * registers them with the ParallelEventProcessor, and load retrieves those
+ * of an event, returning false if it has none, or their number of rows.
+ */
+struct ProductReader {
+    std::function<void(hepnos::ParallelEventProcessor&, const std::string&)> preload;
+    std::function<bool(const hepnos::Event&, const hepnos::ProductCache&, const std::string&, uint64_t&)> load;
+    size_t row_size;
+};
+
+static std::unordered_map<std::string, ProductReader> g_read_product_fn;
+
+// Whether the tables of each type can be decoded into pooled buffers
+static std::unordered_map<std::string, bool> g_product_poolable;
+
+/**
+ * Counts of each subrun compared by --verify: number of events, then the
+ * number of products and of rows of each product of g_product_names.
+ */
+typedef std::map<SubRunCache::Key, std::vector<uint64_t>> SubRunCounts;
 
 static void parse_arguments(int argc, char** argv);
-static int read_input_file(WorkQueue& work_queue);
+static std::vector<std::string> read_input_file();
+static void build_manifest(const std::vector<std::string>& input_files, Manifest& manifest);
 static void create_output_dataset(const hepnos::DataStore& datastore);
-static void process_hdf5_file(hepnos::DataSet& dataset, const std::string& filename, hepnos::WriteBatch& wb);
+static void process_hdf5_file(const WorkUnit& unit, OutputSink& sink, const TableConsumer& store);
+static void read_hdf5_file(const WorkUnit& unit, const TableConsumer& consume);
+static void begin_subrun(OutputSink& sink, const std::string& filename);
+static bool flush_output(OutputSink& sink);
+static int push_work_units(AbstractWorkQueue& work_queue, const std::vector<std::string>& input_files,
+                           const Manifest& manifest, const Journal* journal);
 static void prepare_product_loading_functions();
+static void prefetch_file(const std::string& filename);
+static void report_allocations();
+static void report_file_io();
+static void report_memory();
+static void share_file_sizes(const std::vector<std::string>& input_files, const Manifest& manifest);
+static bool read_file_image(const std::string& filename, std::vector<char>& image);
+static std::vector<std::string> split_collective_files(std::vector<std::string>& input_files,
+                                                       const Manifest& manifest, MPI_Comm& group_comm);
+static void read_hdf5_file_collective(const std::string& filename, MPI_Comm comm,
+                                      const TableConsumer& consume);
+static SubRunCache::Key subrun_of_file(const std::string& filename);
+static void create_subruns(const std::vector<std::string>& input_files, hepnos::DataStore& datastore,
+                           SubRunCache& cache);
+static bool verify_dataset(hepnos::DataStore& datastore, std::vector<std::string>& input_files);
 
 
 int main(int argc, char** argv) {
 
-    MPI_Init(&argc, &argv);
+    int mpi_thread_level;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &mpi_thread_level);
     MPI_Comm_rank(MPI_COMM_WORLD, &g_rank);
     MPI_Comm_size(MPI_COMM_WORLD, &g_size);
 
-    int num_files_processed = 0;
-    int total_files_processed = 0;
-    int total_files = 0;
+    std::atomic<int> num_units_processed{0};
+    PipelineStatistics pipeline_stats;
+    tl::mutex pipeline_stats_mtx;
+    HEPnOSSink::RPCStatistics rpc_stats;
+    tl::mutex rpc_stats_mtx;
+    std::vector<double> compression_stats; // bytes in, bytes out and seconds of each product
+    tl::mutex compression_stats_mtx;
+    int total_units_processed = 0;
+    int total_units = 0;
     std::stringstream str_format;
     str_format << "[" << std::setw(6) << std::setfill('0') << g_rank << "|" << g_size
                << "] [%H:%M:%S.%F] [%n] [%^%l%$] %v";
@@ -87,8 +319,65 @@ int main(int argc, char** argv) {
     spdlog::debug("batch size: {}", g_batch_size);
     spdlog::debug("product label: {}", g_product_label);
     spdlog::debug("run offset: {}", g_run_offset);
+    spdlog::debug("scheduling: {}", g_scheduling == WorkQueue::LONGEST_FIRST ? "longest-first" : "fifo");
+    spdlog::debug("manifest file: {}", g_manifest_file);
+    spdlog::debug("work queue: {}", g_distributed_queue ? "distributed" : "centralized");
+    spdlog::debug("lookahead: {}", g_lookahead);
+    spdlog::debug("workers: {}", g_num_workers);
+    spdlog::debug("work unit: {}", g_split_products ? "product" : "file");
+    spdlog::debug("rows per unit: {}", g_rows_per_unit);
+    spdlog::debug("pipeline: {} (depth {})", g_pipeline, g_pipeline_depth);
+    spdlog::debug("streaming: {} (memory limit {} MB)", g_streaming, g_memory_limit/(1024*1024));
+    spdlog::debug("journal: {} (resume {})", g_journal_file, g_resume);
+    spdlog::debug("report file: {}", g_report_file);
+    spdlog::debug("output sink: {} {}", g_sink_type, g_sink_file);
+    spdlog::debug("auto batch latency: {} ms", g_auto_batch_latency*1000);
+    spdlog::debug("reuse buffers: {}", g_reuse_buffers);
+    spdlog::debug("collective reads: files from {} MB, groups of {}",
+                  g_collective_threshold/(1024*1024), g_collective_group);
+    spdlog::debug("flush every: {} units", g_flush_every);
+    spdlog::debug("bulk: {}", g_bulk);
+    spdlog::debug("raw layout: {}", g_raw_layout);
+    spdlog::debug("verify: {}", g_verify);
+    spdlog::debug("memory images: files up to {} MB", g_memory_image_threshold/(1024*1024));
+    spdlog::debug("memory budget: {} MB", g_memory_budget_size/(1024*1024));
+    for(auto& entry : g_product_compression)
+        spdlog::debug("compression of {}: {} (level {})", entry.first,
+                      Compressor::to_string(entry.second.first), entry.second.second);
+
+    if(g_num_workers > 1 && mpi_thread_level < MPI_THREAD_MULTIPLE) {
+        spdlog::warn("MPI does not provide MPI_THREAD_MULTIPLE, using a single worker");
+        g_num_workers = 1;
+    }
+    if(!g_distributed_queue && g_size > 1 && mpi_thread_level < MPI_THREAD_MULTIPLE) {
+        if(g_rank == 0) spdlog::warn("MPI does not provide MPI_THREAD_MULTIPLE, "
+                                     "which the centralized work queue requires, using the distributed queue");
+        g_distributed_queue = true;
+    }
+#ifndef H5_HAVE_PARALLEL
+    if(g_collective_threshold > 0) {
+        if(g_rank == 0) spdlog::warn("HDF5 was built without MPI-IO support, ignoring --collective-threshold");
+        g_collective_threshold = 0;
+    }
+#endif
 
     prepare_product_loading_functions();
+    g_profiler.init(g_product_names);
+    if(g_reuse_buffers && g_rank == 0) {
+        // Buffers can only be reused for classes whose from_hdf5 fills existing vectors
+        std::string not_pooled;
+        for(auto& p : g_product_names) {
+            if(g_product_poolable[p]) continue;
+            not_pooled += (not_pooled.empty() ? "" : ", ") + p;
+        }
+        if(not_pooled.size())
+            spdlog::warn("Tables of {} are allocated for each file, their classes cannot decode "
+                         "into existing buffers{}", not_pooled,
+                         g_streaming ? "" : "; without --streaming, no buffer is reused for them");
+    }
+    // Pools keep one buffer per table that can be in memory at once
+    BufferPoolBase::set_max_free(g_num_workers * (g_pipeline ? g_pipeline_depth + 2 : 1));
+    g_memory_budget.set_budget(g_memory_budget_size);
 
     if(g_rank == 0) {
         for(auto& p : g_product_names) {
@@ -101,94 +390,496 @@ int main(int argc, char** argv) {
     }
     MPI_Barrier(MPI_COMM_WORLD);
 
-    // Initialize HEPnOS
+    // Initialize HEPnOS, unless products are sent to another sink
+    bool use_hepnos = g_sink_type == "hepnos";
     hepnos::DataStore datastore;
-    try {
-        spdlog::info("Connecting to HEPnOS using file {}", g_connection_file);
-        datastore = hepnos::DataStore::connect(g_protocol, g_connection_file, g_margo_file);
-    } catch(const hepnos::Exception& ex) {
-        spdlog::critical("Could not connect to HEPnOS service: {}", ex.what());
-        MPI_Abort(MPI_COMM_WORLD, 1);
+    if(use_hepnos) {
+        try {
+            spdlog::info("Connecting to HEPnOS using file {}", g_connection_file);
+            datastore = hepnos::DataStore::connect(g_protocol, g_connection_file, g_margo_file);
+        } catch(const hepnos::Exception& ex) {
+            spdlog::critical("Could not connect to HEPnOS service: {}", ex.what());
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
     }
     // Rank 0 create the input dataset if it does not exist
-    if(g_rank == 0 && not g_simulate) {
+    if(g_rank == 0 && use_hepnos && not g_simulate && not g_verify) {
         spdlog::info("Creating output dataset {}", g_output_dataset);
         create_output_dataset(datastore);
         spdlog::info("Done creating the output dataset");
     }
     MPI_Barrier(MPI_COMM_WORLD);
+    // With --verify, the dataset is read back and compared with the input files instead of being loaded
+    if(g_verify) {
+        std::vector<std::string> input_files;
+        if(g_rank == 0) input_files = read_input_file();
+        bool ok = verify_dataset(datastore, input_files);
+        spdlog::info("All done, exiting!");
+        MPI_Finalize();
+        return ok ? 0 : 1;
+    }
     // Get the dataset in which to write the data
     hepnos::DataSet dataset;
-    if(not g_simulate) dataset = datastore.root()[g_output_dataset];
+    if(use_hepnos && not g_simulate) dataset = datastore.root()[g_output_dataset];
     // We need a scope to prevent MPI_Finalize to be called before the destructor of WorkQueue
     double start_time = MPI_Wtime();
     {
         // Initialize the work queue
         spdlog::info("Initializing work queue");
-        WorkQueue work_queue(MPI_COMM_WORLD);
+        std::unique_ptr<AbstractWorkQueue> work_queue_ptr;
+        if(g_distributed_queue)
+            work_queue_ptr.reset(new DistributedWorkQueue(MPI_COMM_WORLD, g_scheduling));
+        else
+            work_queue_ptr.reset(new WorkQueue(MPI_COMM_WORLD, g_scheduling));
+        PrefetchingWorkQueue* prefetching_queue = nullptr;
+        if(g_lookahead > 0) {
+            prefetching_queue = new PrefetchingWorkQueue(std::move(work_queue_ptr), g_lookahead);
+            work_queue_ptr.reset(prefetching_queue);
+        }
+        AbstractWorkQueue& work_queue = *work_queue_ptr;
         spdlog::debug("Queue initialized");
+        // Open the journal of completed work units
+        std::unique_ptr<Journal> journal;
+        if(not g_journal_file.empty() && not g_simulate)
+            journal.reset(new Journal(g_journal_file, g_rank));
         // Rank 0 read the list of files
+        std::vector<std::string> input_files;
         if(g_rank == 0) {
             spdlog::info("Reading input file list");
-            total_files = read_input_file(work_queue);
+            input_files = read_input_file();
             spdlog::info("Done reading input file list");
+            if(journal && g_resume) {
+                size_t num_entries = journal->load();
+                spdlog::info("Loaded {} entries from journal {}", num_entries, g_journal_file);
+                std::vector<std::string> remaining_files;
+                for(auto& filename : input_files) {
+                    WorkUnit unit;
+                    unit.filename = filename;
+                    if(!journal->is_done(unit, g_product_names))
+                        remaining_files.push_back(filename);
+                }
+                spdlog::info("Resuming with {} of {} files", remaining_files.size(), input_files.size());
+                input_files = std::move(remaining_files);
+            }
+        }
+        // Everyone participates in building the manifest if needed
+        Manifest manifest;
+        if(not g_manifest_file.empty()) {
+            spdlog::info("Building manifest of input files");
+            build_manifest(input_files, manifest);
+            spdlog::info("Done building manifest");
+            if(g_memory_image_threshold > 0)
+                share_file_sizes(input_files, manifest);
+        }
+        // Runs and subruns are created up front, in bulk, by all the processes
+        std::unique_ptr<SubRunCache> subrun_cache;
+        if(use_hepnos && not g_simulate) {
+            subrun_cache.reset(new SubRunCache(dataset));
+            create_subruns(input_files, datastore, *subrun_cache);
+        }
+        // Large files are taken out of the list and assigned to groups of processes
+        MPI_Comm group_comm = MPI_COMM_NULL;
+        std::vector<std::string> collective_files;
+        if(g_collective_threshold > 0)
+            collective_files = split_collective_files(input_files, manifest, group_comm);
+        int group_rank = 0;
+        if(group_comm != MPI_COMM_NULL) MPI_Comm_rank(group_comm, &group_rank);
+        // Rank 0 fills the work queue
+        if(g_rank == 0) {
+            total_units = push_work_units(work_queue, input_files, manifest,
+                                          g_resume ? journal.get() : nullptr);
+            spdlog::info("Created {} work units from {} files", total_units, input_files.size());
         }
         // Everyone marks the work queue as read-only from now on
         work_queue.readonly();
         MPI_Barrier(MPI_COMM_WORLD);
         if(g_rank == 0) work_queue.start_listening();
-        // Initialize write batch
-        hepnos::WriteBatch write_batch;
+        // Initialize the AsyncEngine shared by all the workers
         hepnos::AsyncEngine async;
-        if(g_use_batching && not g_simulate) {
-            spdlog::debug("Initializing WriteBatch");
-            if(g_use_async) {
-                spdlog::debug("WriteBatch will use an AsyncEngine with {} threads", g_num_async_threads);
-                async = hepnos::AsyncEngine(datastore, g_num_async_threads);
-                write_batch = hepnos::WriteBatch(async, g_batch_size);
+        if(g_use_batching && use_hepnos && not g_simulate && g_use_async) {
+            spdlog::debug("Initializing AsyncEngine with {} threads", g_num_async_threads);
+            async = hepnos::AsyncEngine(datastore, g_num_async_threads);
+        }
+        // Pulls the next work unit from the queue, prefetching the files reserved after it
+        auto pull_unit = [&]() {
+            double t = MPI_Wtime();
+            if(g_timeout > 0 && (t - start_time) > g_timeout)
+                work_queue.clear();
+            std::string work;
+            {
+                Profiler::Timer timer(g_profiler, Profiler::PULL);
+                work = work_queue.pull();
+            }
+            WorkUnit unit = WorkUnit::from_string(work);
+            if(prefetching_queue) {
+                for(auto& next : prefetching_queue->take_new_reservations()) {
+                    auto next_filename = WorkUnit::from_string(next).filename;
+                    if(next_filename != unit.filename) prefetch_file(next_filename);
+                }
+            }
+            return unit;
+        };
+        // Each worker pulls files from the queue and processes them with its own sink
+        auto worker = [&](int worker_id) {
+            auto make_batch = [&](size_t size) {
+                hepnos::WriteBatch write_batch;
+                if(g_use_batching && not g_simulate) {
+                    spdlog::debug("Initializing WriteBatch of size {} for worker {}", size, worker_id);
+                    if(g_use_async) {
+                        write_batch = hepnos::WriteBatch(async, size);
+                    } else {
+                        write_batch = hepnos::WriteBatch(datastore, size);
+                    }
+                    write_batch.activateStatistics();
+                }
+                return write_batch;
+            };
+            // With per-product batch sizes, events and each product have their own WriteBatch
+            std::vector<std::string> batch_names;
+            std::vector<size_t> batch_sizes;
+            if(g_auto_batch_latency > 0 || !g_product_batch_sizes.empty()) {
+                batch_names.push_back("events");
+                batch_names.insert(batch_names.end(), g_product_names.begin(), g_product_names.end());
             } else {
-                spdlog::debug("WriteBatch will not use any AsyncEngine");
-                write_batch = hepnos::WriteBatch(datastore, g_batch_size);
+                batch_names.push_back("all");
             }
-            write_batch.activateStatistics();
-        }
-        // Process HDF5 files
-        try {
-            while(true) {
-                double t = MPI_Wtime();
-                if(g_timeout > 0 && (t - start_time) > g_timeout)
-                    work_queue.clear();
-                std::string filename = work_queue.pull();
-                process_hdf5_file(dataset, filename, write_batch);
-                num_files_processed += 1;
+            for(auto& name : batch_names) {
+                auto it = g_product_batch_sizes.find(name);
+                batch_sizes.push_back(it == g_product_batch_sizes.end() ? g_batch_size : it->second);
+            }
+            std::unique_ptr<OutputSink> sink;
+            HEPnOSSink* hepnos_sink = nullptr;
+            if(g_sink_type == "discard") {
+                sink.reset(new DiscardSink());
+            } else if(g_sink_type == "file") {
+                sink.reset(new FileSink(g_sink_file + "." + std::to_string(g_rank) + "." + std::to_string(worker_id)));
+            } else {
+                hepnos_sink = new HEPnOSSink(dataset, batch_sizes, make_batch,
+                                             g_use_batching && g_use_async, g_auto_batch_latency,
+                                             subrun_cache.get());
+                sink.reset(hepnos_sink);
+            }
+            for(auto& entry : g_product_compression)
+                sink->set_compression(g_profiler.product_index(entry.first),
+                                      entry.second.first, entry.second.second);
+            sink->set_raw_layout(g_raw_layout);
+            // Logs the batch sizes chosen by the tuner
+            auto log_batch_sizes = [&]() {
+                if(!hepnos_sink || g_auto_batch_latency <= 0) return;
+                auto new_sizes = hepnos_sink->batch_sizes();
+                for(size_t i = 0; i < new_sizes.size(); i++) {
+                    if(new_sizes[i] == batch_sizes[i]) continue;
+                    spdlog::info("Worker {} changed WriteBatch size for {} from {} to {}",
+                                 worker_id, batch_names[i], batch_sizes[i], new_sizes[i]);
+                }
+                batch_sizes = new_sizes;
+            };
+            // Units are recorded in the journal only once a flush
+            // guarantees that their data has been stored
+            std::vector<WorkUnit> unflushed_units;
+            auto record_units = [&]() {
+                if(journal && !journal->record(unflushed_units))
+                    spdlog::error("Could not record completed work units in journal {}", g_journal_file);
+                unflushed_units.clear();
+            };
+            // Data stored since the last flush counts in the memory budget
+            // until a flush guarantees that it left the WriteBatches
+            size_t unflushed_bytes = 0;
+            auto store_table = [&](std::unique_ptr<DecodedTable> table) {
+                size_t bytes = g_simulate ? 0 : table->num_bytes();
+                table->store(*sink);
+                table.reset();
+                unflushed_bytes += bytes;
+                g_memory_budget.acquire(bytes);
+            };
+            auto release_unflushed = [&]() {
+                g_memory_budget.release(unflushed_bytes);
+                unflushed_bytes = 0;
+            };
+            // Flushes the WriteBatches even if they use an AsyncEngine
+            auto drain = [&]() {
+                if(unflushed_bytes == 0) return;
+                {
+                    Profiler::Timer timer(g_profiler, Profiler::FLUSH);
+                    sink->drain();
+                }
+                release_unflushed();
+                record_units();
+            };
+            // Called between tables: pauses reading while the budget is exceeded,
+            // after releasing what this worker holds
+            auto wait_for_memory = [&]() {
+                if(!g_memory_budget.exceeded()) return;
+                drain();
+                g_memory_budget.wait();
+            };
+            // Flushing every few units lets the WriteBatches accumulate more
+            // key/value pairs per destination database, hence fewer, larger RPCs
+            int units_since_flush = 0;
+            auto complete_unit = [&](const WorkUnit& unit) {
+                unflushed_units.push_back(unit);
+                units_since_flush += 1;
+                if(units_since_flush >= g_flush_every) {
+                    units_since_flush = 0;
+                    if(flush_output(*sink)) {
+                        record_units();
+                        release_unflushed();
+                    }
+                    log_batch_sizes();
+                }
+                num_units_processed += 1;
+            };
+            // Worker 0 first loads its share of the large files assigned to its group,
+            // which the other processes of the group load at the same time
+            if(worker_id == 0) {
+                for(auto& filename : collective_files) {
+                    begin_subrun(*sink, filename);
+                    read_hdf5_file_collective(filename, group_comm, [&](std::unique_ptr<DecodedTable> table) {
+                        store_table(std::move(table));
+                        wait_for_memory();
+                    });
+                    flush_output(*sink);
+                    log_batch_sizes();
+                    if(group_rank == 0) num_units_processed += 1;
+                }
+            }
+            if(g_pipeline) {
+                // A reader ULT on its own execution stream decodes tables into
+                // the buffer while this thread stores the previous ones
+                PipelineStatistics stats;
+                BoundedBuffer<PipelineItem> buffer(g_pipeline_depth);
+                auto reader = [&]() {
+                    double t_start = MPI_Wtime();
+                    try {
+                        while(true) {
+                            WorkUnit unit = pull_unit();
+                            double t0 = MPI_Wtime();
+                            double wait = 0.0;
+                            read_hdf5_file(unit, [&](std::unique_ptr<DecodedTable> table) {
+                                double t1 = MPI_Wtime();
+                                buffer.push(PipelineItem{unit, std::move(table)});
+                                // The writer holds the unflushed data, it drains
+                                // the sink before the reader waits for memory
+                                if(g_memory_budget.exceeded()) {
+                                    buffer.push(PipelineItem{unit, nullptr, true});
+                                    g_memory_budget.wait();
+                                }
+                                wait += MPI_Wtime() - t1;
+                            });
+                            double t1 = MPI_Wtime();
+                            buffer.push(PipelineItem{unit, nullptr});
+                            wait += MPI_Wtime() - t1;
+                            stats.reader_busy += (t1 - t0) - wait;
+                            stats.reader_wait += wait;
+                        }
+                    } catch(AbstractWorkQueue::EmptyQueueException& ex) {}
+                    buffer.close();
+                    stats.reader_total = MPI_Wtime() - t_start;
+                };
+                auto reader_es = tl::xstream::create();
+                auto reader_ult = reader_es->make_thread(reader);
+                double t_start = MPI_Wtime();
+                PipelineItem item;
+                bool unit_started = false;
+                while(true) {
+                    double t0 = MPI_Wtime();
+                    if(!buffer.pop(item)) break;
+                    double t1 = MPI_Wtime();
+                    if(item.drain) {
+                        drain();
+                    } else {
+                        if(!unit_started) {
+                            begin_subrun(*sink, item.unit.filename);
+                            unit_started = true;
+                        }
+                        if(item.table) {
+                            store_table(std::move(item.table));
+                        } else {
+                            complete_unit(item.unit);
+                            unit_started = false;
+                        }
+                    }
+                    stats.writer_wait += t1 - t0;
+                    stats.writer_busy += MPI_Wtime() - t1;
+                }
+                stats.writer_total = MPI_Wtime() - t_start;
+                reader_ult->join();
+                reader_es->join();
+                spdlog::info("Pipeline of worker {}: reader busy {:.1f}% (blocked on full buffer {:.1f}%), "
+                             "writer busy {:.1f}% (blocked on empty buffer {:.1f}%)", worker_id,
+                             100.0*stats.reader_busy/stats.reader_total, 100.0*stats.reader_wait/stats.reader_total,
+                             100.0*stats.writer_busy/stats.writer_total, 100.0*stats.writer_wait/stats.writer_total);
+                std::unique_lock<tl::mutex> lock(pipeline_stats_mtx);
+                pipeline_stats += stats;
+            } else {
+                // Process HDF5 files
+                try {
+                    while(true) {
+                        WorkUnit unit = pull_unit();
+                        process_hdf5_file(unit, *sink, [&](std::unique_ptr<DecodedTable> table) {
+                            store_table(std::move(table));
+                            wait_for_memory();
+                        });
+                        complete_unit(unit);
+                    }
+                } catch(AbstractWorkQueue::EmptyQueueException& ex) {}
             }
-        } catch(WorkQueue::EmptyQueueException& ex) {}
+            spdlog::info("Work completed for worker {}!", worker_id);
+            if(not g_simulate) {
+                spdlog::info("Waiting for output of worker {} to flush...", worker_id);
+                {
+                    Profiler::Timer timer(g_profiler, Profiler::FLUSH);
+                    sink->finish();
+                }
+                release_unflushed();
+                record_units();
+                if(hepnos_sink) {
+                    auto stats = hepnos_sink->statistics();
+                    for(size_t i = 0; i < stats.size(); i++)
+                        spdlog::info("WriteBatch statistics for worker {} ({}): {}", worker_id, batch_names[i], stats[i]);
+                    if(g_auto_batch_latency > 0) {
+                        // Printed as arguments so that these sizes can be reused
+                        std::string args;
+                        for(size_t i = 0; i < batch_sizes.size(); i++)
+                            args += " --product-batch-size " + batch_names[i] + "=" + std::to_string(batch_sizes[i]);
+                        spdlog::info("Final WriteBatch sizes for worker {}:{}", worker_id, args);
+                    }
+                    auto rpcs = hepnos_sink->rpc_statistics();
+                    if(g_use_async)
+                        spdlog::info("Worker {} sent {} RPCs ({} bytes) in the background", worker_id,
+                                     rpcs.rpcs, rpcs.bytes);
+                    else
+                        spdlog::info("Worker {} sent {} RPCs ({} bytes) in {} flushes", worker_id,
+                                     rpcs.rpcs, rpcs.bytes, rpcs.flushes);
+                    std::unique_lock<tl::mutex> lock(rpc_stats_mtx);
+                    rpc_stats.flushes += rpcs.flushes;
+                    rpc_stats.rpcs    += rpcs.rpcs;
+                    rpc_stats.bytes   += rpcs.bytes;
+                } else {
+                    spdlog::info("Output of worker {}: {} products, {} bytes serialized",
+                                 worker_id, sink->num_products(), sink->num_bytes());
+                }
+                if(not g_product_compression.empty()) {
+                    std::unique_lock<tl::mutex> lock(compression_stats_mtx);
+                    compression_stats.resize(3*g_product_names.size());
+                    for(size_t i = 0; i < g_product_names.size(); i++) {
+                        auto cs = sink->compression_statistics(i);
+                        compression_stats[3*i]   += cs.bytes_in;
+                        compression_stats[3*i+1] += cs.bytes_out;
+                        compression_stats[3*i+2] += cs.seconds;
+                    }
+                }
+            }
+        };
+        // Spawn additional workers on their own execution streams
+        std::vector<tl::managed<tl::xstream>> worker_es;
+        std::vector<tl::managed<tl::thread>>  worker_ults;
+        for(int i = 1; i < g_num_workers; i++) {
+            worker_es.push_back(tl::xstream::create());
+            worker_ults.push_back(worker_es.back()->make_thread([&worker, i]() { worker(i); }));
+        }
+        worker(0);
+        for(auto& ult : worker_ults) ult->join();
+        for(auto& es : worker_es) es->join();
         spdlog::info("Work completed!");
-        if(not g_simulate) {
-            spdlog::info("Waiting for WriteBatch to flush...");
-            write_batch.flush();
-            hepnos::WriteBatchStatistics stats;
-            write_batch.collectStatistics(stats);
-            spdlog::info("WriteBatch statistics: {}", stats);
+        // A large file is complete once all the processes of its group have
+        // stored their share, which is only sure after they all finished
+        if(g_collective_threshold > 0) {
+            MPI_Barrier(MPI_COMM_WORLD);
+            if(journal && group_rank == 0) {
+                std::vector<WorkUnit> units(collective_files.size());
+                for(size_t i = 0; i < units.size(); i++) units[i].filename = collective_files[i];
+                if(!journal->record(units))
+                    spdlog::error("Could not record completed work units in journal {}", g_journal_file);
+            }
         }
+        if(group_comm != MPI_COMM_NULL) MPI_Comm_free(&group_comm);
+        if(subrun_cache)
+            spdlog::info("Subrun cache: {} hits, {} subruns created while loading",
+                         subrun_cache->hits(), subrun_cache->misses());
     }
     double end_time = MPI_Wtime();
-    MPI_Reduce(&num_files_processed, &total_files_processed, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+    if(g_pipeline) {
+        PipelineStatistics total_pipeline_stats;
+        MPI_Reduce(&pipeline_stats, &total_pipeline_stats, sizeof(PipelineStatistics)/sizeof(double),
+                   MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+        if(g_rank == 0) {
+            auto& ps = total_pipeline_stats;
+            std::cout << "PIPELINE: READER BUSY " << 100.0*ps.reader_busy/ps.reader_total << "%"
+                      << " BLOCKED " << 100.0*ps.reader_wait/ps.reader_total << "%"
+                      << " WRITER BUSY " << 100.0*ps.writer_busy/ps.writer_total << "%"
+                      << " BLOCKED " << 100.0*ps.writer_wait/ps.writer_total << "%" << std::endl;
+        }
+    }
+    if(g_use_batching && g_sink_type == "hepnos" && not g_simulate) {
+        uint64_t local[3] = { rpc_stats.flushes, rpc_stats.rpcs, rpc_stats.bytes };
+        uint64_t total[3] = { 0, 0, 0 };
+        MPI_Reduce(local, total, 3, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+        if(g_rank == 0 && total[1] > 0) {
+            // No flushes are counted with an AsyncEngine, so there is no per-flush figure
+            std::cout << "RPCS: " << total[1];
+            if(total[0] > 0) std::cout << " PER FLUSH: " << (double)total[1]/total[0];
+            std::cout << " BYTES PER RPC: " << (double)total[2]/total[1] << std::endl;
+        }
+    }
+    if(not g_product_compression.empty() && not g_simulate) {
+        compression_stats.resize(3*g_product_names.size());
+        std::vector<double> total(compression_stats.size());
+        MPI_Reduce(compression_stats.data(), total.data(), total.size(), MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+        for(size_t i = 0; g_rank == 0 && i < g_product_names.size(); i++) {
+            if(total[3*i] == 0 || total[3*i+1] == 0) continue;
+            auto it = g_product_compression.find(g_product_names[i]);
+            std::cout << "COMPRESSION: " << g_product_names[i] << " " << Compressor::to_string(it->second.first)
+                      << " RATIO " << total[3*i]/total[3*i+1] << " CPU " << total[3*i+2] << " s";
+            if(total[3*i+2] > 0)
+                std::cout << " (" << total[3*i]/(1024*1024)/total[3*i+2] << " MB/s)";
+            std::cout << std::endl;
+        }
+    }
+    if(not g_report_file.empty()) {
+        if(!g_profiler.report(MPI_COMM_WORLD, 0, g_report_file))
+            spdlog::error("Could not write report to {}", g_report_file);
+        else if(g_rank == 0)
+            spdlog::info("Report written to {}", g_report_file);
+    }
+    report_allocations();
+    report_file_io();
+    report_memory();
+    int local_units_processed = num_units_processed.load();
+    MPI_Reduce(&local_units_processed, &total_units_processed, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
     spdlog::info("All done, exiting!");
-    spdlog::info("Created {} events and {} products", g_total_events, g_total_products);
+    spdlog::info("Created {} events and {} products", g_total_events.load(), g_total_products.load());
     if(g_rank == 0) {
-        std::cout << "TIME: " << (end_time-start_time) << " FILES: " << total_files_processed << "/" << total_files << std::endl;
-        std::cout << "ESTIMATED TOTAL TIME: " << (end_time-start_time)*total_files/(double)total_files_processed << std::endl;
+        std::cout << "TIME: " << (end_time-start_time) << (g_split_products ? " UNITS: " : " FILES: ")
+                  << total_units_processed << "/" << total_units << std::endl;
+        std::cout << "ESTIMATED TOTAL TIME: " << (end_time-start_time)*total_units/(double)total_units_processed << std::endl;
     }
     MPI_Finalize();
 }
 
+/**
+ * Parses a whole string as an integer, returning false if it is not one.
+ */
+static bool parse_integer(const std::string& str, long long& value) {
+    size_t pos = 0;
+    try {
+        value = std::stoll(str, &pos);
+    } catch(const std::logic_error&) { // invalid_argument or out_of_range
+        return false;
+    }
+    return pos == str.size();
+}
+
+static bool is_product_name(const std::string& name) {
+    return std::find(g_product_names.begin(), g_product_names.end(), name) != g_product_names.end();
+}
+
 static void parse_arguments(int argc, char** argv) {
     try {
 
         TCLAP::CmdLine cmd("Loads HDF5 files into HEPnOS", ' ', "0.5");
-        TCLAP::ValueArg<std::string> protocol("p","protocol", "Mercury protocol", true, "", "string");
-        TCLAP::ValueArg<std::string> clientFile("c", "connection", "JSON connection file for HEPnOS", true, "", "string");
+        TCLAP::ValueArg<std::string> protocol("p","protocol", "Mercury protocol", false, "", "string");
+        TCLAP::ValueArg<std::string> clientFile("c", "connection", "JSON connection file for HEPnOS", false, "", "string");
         TCLAP::ValueArg<std::string> margoFile("m", "margo-config", "JSON configuration for margo", false, "", "string");
         TCLAP::ValueArg<std::string> fileName("i", "input", "Input file containing list of HDF5 files", true, "", "string");
         TCLAP::ValueArg<std::string> dataSetName("o", "output", "DataSet in which to store the data", true, "", "string");
@@ -203,6 +894,73 @@ static void parse_arguments(int argc, char** argv) {
             "Name of the products to load", false, "string");
         TCLAP::ValueArg<int> timeout("", "timeout", "Run for only the specified time (sec)", false, -1, "int");
         TCLAP::ValueArg<hepnos::RunNumber> runOffset("", "run-offset", "Add this offset to run numbers", false, 0, "int");
+        TCLAP::ValueArg<std::string> scheduling("", "scheduling", "Order in which files are distributed", false, "fifo",
+                                                "fifo,longest-first");
+        TCLAP::ValueArg<std::string> manifestFile("", "manifest",
+            "File caching the size and row counts of input files (default with longest-first: <input>.manifest)",
+            false, "", "string");
+        TCLAP::ValueArg<std::string> queueType("", "queue", "Work queue implementation", false, "centralized",
+                                               "centralized,distributed");
+        TCLAP::ValueArg<int> numWorkers("w", "workers", "Number of files processed concurrently by each process",
+                                        false, 1, "int");
+        TCLAP::ValueArg<std::string> workUnit("", "work-unit", "Granularity of the work distributed to processes",
+                                              false, "file", "file,product");
+        TCLAP::ValueArg<uint64_t> rowsPerUnit("", "rows-per-unit",
+            "Split product tables into work units of at most this many rows (requires --work-unit product)",
+            false, 0, "int");
+        TCLAP::SwitchArg pipeline("", "pipeline", "Read the next files while storing the previous ones", false);
+        TCLAP::ValueArg<int> pipelineDepth("", "pipeline-depth", "Number of decoded tables buffered by --pipeline",
+                                           false, 2, "int");
+        TCLAP::SwitchArg streaming("", "streaming", "Read tables in chunks of rows bounded by --memory-limit", false);
+        TCLAP::ValueArg<size_t> memoryLimit("", "memory-limit",
+            "Memory (MB) each process may use for decoded rows with --streaming", false, 1024, "int");
+        TCLAP::ValueArg<std::string> journalFile("", "journal",
+            "Record completed work units in <journal>.<rank> (default with --resume: <input>.journal)",
+            false, "", "string");
+        TCLAP::SwitchArg resume("", "resume", "Skip the work units recorded in the journal by previous runs", false);
+        TCLAP::ValueArg<std::string> reportFile("", "report",
+            "Write the time spent in each phase, per product and across processes, to this file (.json or .csv)",
+            false, "", "string");
+        TCLAP::ValueArg<std::string> sinkType("", "sink",
+            "Where to send products: HEPnOS, nowhere after serializing them, or a local file",
+            false, "hepnos", "hepnos,discard,file");
+        TCLAP::ValueArg<std::string> sinkFile("", "sink-file",
+            "Prefix of the files written with --sink file (default: <output>.sink)", false, "", "string");
+        TCLAP::ValueArg<double> autoBatch("", "auto-batch",
+            "Tune the WriteBatch size of events and each product so that a batch is filled and flushed in this time (ms)",
+            false, 0.0, "float");
+        TCLAP::MultiArg<std::string> productBatchSizes("", "product-batch-size",
+            "WriteBatch size for a product (or events), as name=size", false, "string");
+        TCLAP::ValueArg<int> collectiveThreshold("", "collective-threshold",
+            "Files of at least this size (MB) are read by a group of processes with collective MPI-IO (0 to disable)",
+            false, 0, "int");
+        TCLAP::ValueArg<int> collectiveGroup("", "collective-group",
+            "Number of processes reading each file with --collective-threshold", false, 4, "int");
+        TCLAP::ValueArg<int> flushEvery("", "flush-every",
+            "Number of work units each worker completes between flushes of its WriteBatches", false, 1, "int");
+        TCLAP::MultiArg<std::string> compress("", "compress",
+            "Compress the products of a type (or all) before storing them, as name=codec[:level] "
+            "with codec zlib, lz4 or zstd", false, "string");
+        TCLAP::SwitchArg bulk("", "bulk",
+            "Store each table as a single product of its subrun, indexed by event, instead of one product per event",
+            false);
+        TCLAP::SwitchArg rawLayout("", "raw-layout",
+            "Store the products of trivially copyable types as their raw rows after a small header "
+            "instead of serializing them row by row (compressed products are not affected)", false);
+        TCLAP::SwitchArg verify("", "verify",
+            "Instead of loading the input files, read the output dataset back, compare its events and "
+            "products with the input files and report the read throughput", false);
+        TCLAP::ValueArg<int> memoryImageThreshold("", "memory-image-threshold",
+            "Files of at most this size (MB) are read entirely with large sequential reads and opened from memory "
+            "(0 to disable)", false, 0, "int");
+        TCLAP::ValueArg<size_t> memoryBudget("", "memory-budget",
+            "Memory (MB) each process may hold in decoded tables and data not flushed yet, "
+            "reading pauses while it is exceeded (0 for no limit)", false, 0, "int");
+        TCLAP::SwitchArg noBufferReuse("", "no-buffer-reuse",
+            "Allocate new buffers for each table instead of reusing those of previous tables "
+            "(tables are only reused for classes whose from_hdf5 fills existing vectors)", false);
+        TCLAP::ValueArg<int> lookahead("", "lookahead", "Number of files to reserve ahead of the one being processed",
+                                       false, 0, "int");
 
         cmd.add(protocol);
         cmd.add(clientFile);
@@ -218,6 +976,34 @@ static void parse_arguments(int argc, char** argv) {
         cmd.add(productNames);
         cmd.add(timeout);
         cmd.add(runOffset);
+        cmd.add(scheduling);
+        cmd.add(manifestFile);
+        cmd.add(queueType);
+        cmd.add(lookahead);
+        cmd.add(numWorkers);
+        cmd.add(workUnit);
+        cmd.add(rowsPerUnit);
+        cmd.add(pipeline);
+        cmd.add(pipelineDepth);
+        cmd.add(streaming);
+        cmd.add(memoryLimit);
+        cmd.add(journalFile);
+        cmd.add(resume);
+        cmd.add(reportFile);
+        cmd.add(sinkType);
+        cmd.add(sinkFile);
+        cmd.add(autoBatch);
+        cmd.add(productBatchSizes);
+        cmd.add(noBufferReuse);
+        cmd.add(collectiveThreshold);
+        cmd.add(collectiveGroup);
+        cmd.add(flushEvery);
+        cmd.add(compress);
+        cmd.add(bulk);
+        cmd.add(rawLayout);
+        cmd.add(verify);
+        cmd.add(memoryImageThreshold);
+        cmd.add(memoryBudget);
         cmd.parse(argc, argv);
 
         g_protocol          = protocol.getValue();
@@ -235,6 +1021,118 @@ static void parse_arguments(int argc, char** argv) {
         g_product_names     = productNames.getValue();
         g_timeout           = timeout.getValue();
         g_run_offset        = runOffset.getValue();
+        g_manifest_file     = manifestFile.getValue();
+        g_lookahead         = lookahead.getValue();
+        g_num_workers       = std::max(1, numWorkers.getValue());
+        g_pipeline          = pipeline.getValue();
+        g_pipeline_depth    = std::max(1, pipelineDepth.getValue());
+        g_streaming         = streaming.getValue();
+        g_memory_limit      = memoryLimit.getValue()*1024*1024;
+        g_journal_file      = journalFile.getValue();
+        g_resume            = resume.getValue();
+        g_report_file       = reportFile.getValue();
+        g_sink_type         = sinkType.getValue();
+        g_sink_file         = sinkFile.getValue();
+        g_auto_batch_latency = autoBatch.getValue()/1000.0;
+        g_reuse_buffers     = !noBufferReuse.getValue();
+        g_collective_threshold = (uint64_t)std::max(0, collectiveThreshold.getValue())*1024*1024;
+        g_collective_group  = collectiveGroup.getValue();
+        g_flush_every       = flushEvery.getValue();
+        g_memory_image_threshold = (uint64_t)std::max(0, memoryImageThreshold.getValue())*1024*1024;
+        g_memory_budget_size = memoryBudget.getValue()*1024*1024;
+        for(auto& entry : compress.getValue()) {
+            auto eq = entry.find('=');
+            auto colon = entry.find(':', eq);
+            Compressor::Codec codec;
+            if(eq == std::string::npos
+            || !Compressor::from_string(entry.substr(eq+1, colon == std::string::npos ? colon : colon-eq-1), codec))
+                throw TCLAP::ArgException("Invalid compression " + entry, "compress");
+            if(!Compressor::available(codec))
+                throw TCLAP::ArgException("Codec not available in this build: " + entry, "compress");
+            long long level = 0;
+            if(colon != std::string::npos
+            && (!parse_integer(entry.substr(colon+1), level) || level < INT_MIN || level > INT_MAX))
+                throw TCLAP::ArgException("Invalid compression level in " + entry, "compress");
+            std::string name = entry.substr(0, eq);
+            if(name != "all" && !is_product_name(name))
+                throw TCLAP::ArgException("Unknown product in " + entry, "compress");
+            if(name == "all") {
+                for(auto& p : g_product_names) g_product_compression[p] = std::make_pair(codec, level);
+            } else {
+                g_product_compression[name] = std::make_pair(codec, level);
+            }
+        }
+        if(g_flush_every < 1)
+            throw TCLAP::ArgException("Invalid number of units between flushes", "flush-every");
+        if(g_collective_group < 1)
+            throw TCLAP::ArgException("Invalid collective group size", "collective-group");
+        for(auto& entry : productBatchSizes.getValue()) {
+            auto pos = entry.find('=');
+            if(pos == std::string::npos)
+                throw TCLAP::ArgException("Invalid product batch size " + entry, "product-batch-size");
+            long long size = 0;
+            if(!parse_integer(entry.substr(pos+1), size) || size < 1)
+                throw TCLAP::ArgException("Invalid product batch size " + entry, "product-batch-size");
+            if(entry.substr(0, pos) != "events" && !is_product_name(entry.substr(0, pos)))
+                throw TCLAP::ArgException("Unknown product in " + entry, "product-batch-size");
+            g_product_batch_sizes[entry.substr(0, pos)] = size;
+        }
+        // Tuning or pinning batch sizes implies batching
+        if((g_auto_batch_latency > 0 || !g_product_batch_sizes.empty()) && !g_use_batching) {
+            g_batch_size   = 1024;
+            g_use_batching = true;
+        }
+        if(g_auto_batch_latency > 0 && g_use_async)
+            spdlog::warn("WriteBatch sizes are not tuned when using an AsyncEngine");
+        if(g_resume && g_journal_file.empty())
+            g_journal_file = g_input_filename + ".journal";
+
+        if(scheduling.getValue() == "longest-first") {
+            g_scheduling = WorkQueue::LONGEST_FIRST;
+            if(g_manifest_file.empty())
+                g_manifest_file = g_input_filename + ".manifest";
+        } else if(scheduling.getValue() == "fifo") {
+            g_scheduling = WorkQueue::FIFO;
+        } else {
+            throw TCLAP::ArgException("Invalid scheduling policy", "scheduling");
+        }
+        if(workUnit.getValue() == "product") {
+            g_split_products = true;
+        } else if(workUnit.getValue() == "file") {
+            g_split_products = false;
+        } else {
+            throw TCLAP::ArgException("Invalid work unit", "work-unit");
+        }
+        g_rows_per_unit = g_split_products ? rowsPerUnit.getValue() : 0;
+        if(g_rows_per_unit > 0 && g_manifest_file.empty())
+            g_manifest_file = g_input_filename + ".manifest";
+        if(g_sink_type != "hepnos" && g_sink_type != "discard" && g_sink_type != "file")
+            throw TCLAP::ArgException("Invalid output sink", "sink");
+        if(g_sink_type == "hepnos" && (g_protocol.empty() || g_connection_file.empty()))
+            throw TCLAP::ArgException("Protocol and connection file are required with --sink hepnos", "connection");
+        if(g_sink_type == "file" && g_sink_file.empty())
+            g_sink_file = g_output_dataset + ".sink";
+        // A bulk product holds a whole table, which must therefore be read by a single process at once
+        g_bulk              = bulk.getValue();
+        if(g_bulk && (g_streaming || g_rows_per_unit > 0 || g_collective_threshold > 0))
+            throw TCLAP::ArgException("--bulk requires tables to be read entirely by one process", "bulk");
+        if(g_bulk && not g_product_compression.empty())
+            throw TCLAP::ArgException("--compress only applies to per-event products, not with --bulk", "compress");
+        g_raw_layout        = rawLayout.getValue();
+        if(g_raw_layout && g_bulk)
+            throw TCLAP::ArgException("--raw-layout only applies to per-event products, not with --bulk", "raw-layout");
+        g_verify            = verify.getValue();
+        if(g_verify && (g_sink_type != "hepnos" || g_simulate))
+            throw TCLAP::ArgException("--verify reads the dataset back from HEPnOS", "verify");
+        if(g_verify && g_bulk)
+            throw TCLAP::ArgException("--verify only checks per-event products, not with --bulk", "verify");
+        if(queueType.getValue() == "distributed") {
+            g_distributed_queue = true;
+        } else if(queueType.getValue() == "centralized") {
+            g_distributed_queue = false;
+        } else {
+            throw TCLAP::ArgException("Invalid work queue type", "queue");
+        }
 
     } catch(TCLAP::ArgException &e) {
         if(g_rank == 0) {
@@ -244,19 +1142,133 @@ static void parse_arguments(int argc, char** argv) {
     }
 }
 
-static int read_input_file(WorkQueue& work_queue) {
+static std::vector<std::string> read_input_file() {
     std::ifstream infile(g_input_filename);
     if(!infile.good()) {
         spdlog::critical("Coulf not open file {}", g_input_filename);
         MPI_Abort(MPI_COMM_WORLD, 1);
     }
-    int num_files = 0;
+    std::vector<std::string> files;
     std::string line;
     while(std::getline(infile, line)) {
-        work_queue.push(line);
-        num_files += 1;
+        files.push_back(line);
     }
-    return num_files;
+    return files;
+}
+
+static void build_manifest(const std::vector<std::string>& input_files, Manifest& manifest) {
+    // Rank 0 loads the cached manifest and finds which files need to be scanned
+    std::string to_scan;
+    if(g_rank == 0) {
+        if(manifest.load(g_manifest_file))
+            spdlog::info("Loaded {} entries from manifest {}", manifest.size(), g_manifest_file);
+        for(auto& line : manifest.invalid_lines())
+            spdlog::warn("Ignoring malformed manifest entry {}", line);
+        size_t num_cached = 0;
+        for(auto& filename : input_files) {
+            auto info = manifest.find_valid(filename);
+            if(info && info->has_products(g_product_names)) {
+                num_cached += 1;
+            } else {
+                to_scan += filename;
+                to_scan += '\n';
+            }
+        }
+        spdlog::info("{} files found in manifest, {} files need to be scanned",
+                     num_cached, input_files.size() - num_cached);
+    }
+    // The list of files to scan is broadcast to everyone
+    uint64_t to_scan_size = to_scan.size();
+    MPI_Bcast(&to_scan_size, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+    if(to_scan_size == 0) return;
+    to_scan.resize(to_scan_size);
+    MPI_Bcast(const_cast<char*>(to_scan.data()), to_scan_size, MPI_CHAR, 0, MPI_COMM_WORLD);
+    // Each rank scans files in a round-robin manner
+    std::stringstream ss(to_scan);
+    std::string filename;
+    std::string local_result;
+    size_t i = 0;
+    while(std::getline(ss, filename)) {
+        if((int)(i % g_size) == g_rank) {
+            spdlog::debug("Scanning file {}", filename);
+            local_result += Manifest::scan(filename, g_product_names).to_string();
+            local_result += '\n';
+        }
+        i += 1;
+    }
+    // Results are gathered at rank 0
+    int local_size = local_result.size();
+    std::vector<int> sizes(g_size), offsets(g_size);
+    MPI_Gather(&local_size, 1, MPI_INT, sizes.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+    std::string all_results;
+    if(g_rank == 0) {
+        int total = 0;
+        for(int r = 0; r < g_size; r++) {
+            offsets[r] = total;
+            total += sizes[r];
+        }
+        all_results.resize(total);
+    }
+    MPI_Gatherv(local_result.data(), local_size, MPI_CHAR,
+                const_cast<char*>(all_results.data()), sizes.data(), offsets.data(),
+                MPI_CHAR, 0, MPI_COMM_WORLD);
+    if(g_rank != 0) return;
+    std::stringstream rs(all_results);
+    std::string line;
+    while(std::getline(rs, line)) {
+        Manifest::FileInfo info;
+        if(Manifest::FileInfo::from_string(line, info))
+            manifest.update(info);
+        else
+            spdlog::warn("Ignoring malformed prescan result: {}", line);
+    }
+    if(!manifest.save(g_manifest_file))
+        spdlog::warn("Could not save manifest to {}", g_manifest_file);
+}
+
+static int push_work_units(AbstractWorkQueue& work_queue, const std::vector<std::string>& input_files,
+                           const Manifest& manifest, const Journal* journal) {
+    int num_units = 0;
+    int num_skipped = 0;
+    for(auto& filename : input_files) {
+        auto info = manifest.find(filename);
+        if(!g_split_products) {
+            // files already loaded were removed from the input list
+            uint64_t cost = info ? info->cost(g_product_names) : 0;
+            work_queue.push(filename, cost);
+            num_units += 1;
+            continue;
+        }
+        for(auto& product : g_product_names) {
+            WorkUnit unit;
+            unit.filename = filename;
+            unit.product  = product;
+            uint64_t rows = 0;
+            if(info && info->rows.count(product)) rows = info->rows.at(product);
+            if(g_rows_per_unit == 0 || rows == 0) {
+                if(journal && journal->is_done(unit, g_product_names)) {
+                    num_skipped += 1;
+                    continue;
+                }
+                work_queue.push(unit.to_string(), rows);
+                num_units += 1;
+                continue;
+            }
+            for(uint64_t begin = 0; begin < rows; begin += g_rows_per_unit) {
+                unit.begin = begin;
+                unit.end   = std::min(begin + g_rows_per_unit, rows);
+                if(journal && journal->is_done(unit, g_product_names)) {
+                    num_skipped += 1;
+                    continue;
+                }
+                work_queue.push(unit.to_string(), unit.end - unit.begin);
+                num_units += 1;
+            }
+        }
+    }
+    if(num_skipped > 0)
+        spdlog::info("Skipped {} work units found in the journal", num_skipped);
+    return num_units;
 }
 
 static void create_output_dataset(const hepnos::DataStore& datastore) {
@@ -279,51 +1291,426 @@ static void create_output_dataset(const hepnos::DataStore& datastore) {
 }
 
 
+static BufferPool<unsigned>& events_pool() {
+    return BufferPool<unsigned>::instance("events");
+}
+
+template <typename T>
+static BufferPool<T>& table_pool() {
+    return BufferPool<T>::instance(hepnos::demangle<T>());
+}
+
+/**
+ * Detects whether T provides a from_hdf5 variant that fills
+ * caller-provided vectors (runs, subruns, events, rows) instead
+ * of returning new ones.
+ */
+template <typename T, typename = void>
+struct has_from_hdf5_into : std::false_type {};
+
+template <typename T>
+struct has_from_hdf5_into<T, decltype(T::from_hdf5(std::declval<hid_t>(),
+    std::declval<std::vector<unsigned>&>(), std::declval<std::vector<unsigned>&>(),
+    std::declval<std::vector<unsigned>&>(), std::declval<std::vector<T>&>()), void())>
+: std::true_type {};
+
+template <typename T>
+static void from_hdf5_into(hid_t hdf_file, std::vector<unsigned>& events,
+                           std::vector<T>& table, std::true_type) {
+    // The run and subrun columns are not needed, their
+    // buffers are kept by each execution stream
+    static thread_local std::vector<unsigned> runs, subruns;
+    T::from_hdf5(hdf_file, runs, subruns, events, table);
+}
+
+template <typename T>
+static void from_hdf5_into(hid_t hdf_file, std::vector<unsigned>& events,
+                           std::vector<T>& table, std::false_type) {
+    // T::from_hdf5 allocates new vectors anyway, which replace those of
+    // the caller: copying them into pooled vectors would not save any
+    // allocation, so use_buffer_pools() is false for such types
+    std::tie(std::ignore, std::ignore, events, table) = T::from_hdf5(hdf_file);
+}
+
+/**
+ * Reads a table into the provided vectors. Their storage is only
+ * reused if T has a from_hdf5 variant filling existing vectors.
+ */
+template <typename T>
+static void from_hdf5_into(hid_t hdf_file, std::vector<unsigned>& events, std::vector<T>& table) {
+    from_hdf5_into(hdf_file, events, table, has_from_hdf5_into<T>());
+}
+
+/**
+ * Whether the tables of type T are decoded into pooled vectors, which
+ * requires a from_hdf5 variant filling existing vectors. Otherwise
+ * neither the event column nor the rows of the tables are pooled; only
+ * the buffers used by --streaming are.
+ */
+template <typename T>
+static bool use_buffer_pools() {
+    return g_reuse_buffers && has_from_hdf5_into<T>::value;
+}
+
+template <typename T>
+class DecodedTableImpl : public DecodedTable {
+
+    public:
+
+    DecodedTableImpl(int product, std::vector<unsigned>&& events, std::vector<T>&& table,
+                     size_t first_row, size_t last_row, bool pooled = false)
+    : m_product(product)
+    , m_events(std::move(events))
+    , m_table(std::move(table))
+    , m_first_row(first_row)
+    , m_last_row(last_row)
+    , m_pooled(pooled) {
+        g_memory_budget.acquire(_decoded_bytes());
+    }
+
+    ~DecodedTableImpl() {
+        g_memory_budget.release(_decoded_bytes());
+        if(!m_pooled) return;
+        events_pool().release(std::move(m_events));
+        table_pool<T>().release(std::move(m_table));
+    }
+
+    void store(OutputSink& sink) override {
+        auto& events = m_events;
+        auto& table = m_table;
+        auto rows_end = events.cbegin() + m_last_row;
+        auto batch_begin = events.cbegin() + m_first_row;
+        auto checkeve = [](uint64_t i, uint64_t j) { return (i != j); };
+        auto batch_end = std::adjacent_find(batch_begin, rows_end, checkeve);
+
+        // Find the event numbers and the range of rows of each event
+        std::vector<hepnos::EventNumber> event_numbers;
+        std::vector<size_t> event_offsets;
+        while (batch_begin != rows_end) {
+            if (batch_end != rows_end)
+                batch_end = batch_end + 1;
+            event_numbers.push_back(*batch_begin);
+            event_offsets.push_back(batch_begin - events.cbegin());
+            batch_begin = batch_end;
+            batch_end = std::adjacent_find(batch_begin, rows_end, checkeve);
+        }
+        event_offsets.push_back(m_last_row);
+        g_total_products += event_numbers.size();
+        if(g_simulate) return;
+
+        // Create the events that the sink has not seen yet in this subrun.
+        // With --work-unit product, the same event may be created by several
+        // processes (one per table), which is harmless.
+        size_t subrun_events;
+        {
+            Profiler::Timer timer(g_profiler, Profiler::CREATE_EVENTS, m_product);
+            subrun_events = sink.create_events(event_numbers);
+        }
+        g_total_events += subrun_events;
+        g_profiler.add(Profiler::CREATE_EVENTS, m_product, Profiler::ROWS, subrun_events);
+
+        {
+            Profiler::Timer timer(g_profiler, Profiler::STORE, m_product);
+            if(g_bulk)
+                sink.store_bulk(m_product, g_product_label, table, event_offsets);
+            else
+                sink.store(m_product, g_product_label, table, event_offsets);
+        }
+        g_profiler.add(Profiler::STORE, m_product, Profiler::ROWS, m_last_row - m_first_row);
+        g_profiler.add(Profiler::STORE, m_product, Profiler::ROW_BYTES, (m_last_row - m_first_row)*sizeof(T));
+        spdlog::debug("Done storing table {}", hepnos::demangle<T>());
+        spdlog::debug("Created {} new events", subrun_events);
+    }
+
+    size_t num_bytes() const override {
+        return (m_last_row - m_first_row)*sizeof(T);
+    }
+
+    private:
+
+    size_t _decoded_bytes() const {
+        return m_events.size()*sizeof(unsigned) + m_table.size()*sizeof(T);
+    }
+
+    int                   m_product; // index of the product, for the Profiler
+    std::vector<unsigned> m_events; // event number of each row
+    std::vector<T>        m_table; // products
+    size_t                m_first_row; // first row to store
+    size_t                m_last_row; // end of the rows to store
+    bool                  m_pooled; // whether the vectors go back to their pools
+};
+
+static void align_rows(const std::vector<unsigned>& events, uint64_t begin_row, uint64_t end_row,
+                       size_t& first_row, size_t& last_row) {
+    // The range of rows is aligned on event boundaries: we own the events
+    // that start within [begin_row, end_row) and all of their rows
+    first_row = std::min<size_t>(begin_row, events.size());
+    last_row  = end_row == 0 ? events.size() : std::min<size_t>(end_row, events.size());
+    while(first_row > 0 && first_row < last_row && events[first_row] == events[first_row-1])
+        first_row += 1;
+    if(first_row >= last_row) last_row = first_row;
+    while(last_row > first_row && last_row < events.size() && events[last_row] == events[last_row-1])
+        last_row += 1;
+}
+
+static size_t max_chunk_rows(size_t row_size) {
+    // Each worker has a chunk being read and one being stored, plus the
+    // ones waiting in the buffer with --pipeline. A chunk exists up to three
+    // times at once: in the in-memory slice, in HDF5's read buffer, and decoded.
+    size_t chunks_in_flight = g_num_workers * (g_pipeline ? g_pipeline_depth + 2 : 1);
+    size_t budget = g_memory_limit / chunks_in_flight;
+    return std::max<size_t>(1, budget / (3 * row_size));
+}
+
 template <typename T>
-static void process_table(hepnos::SubRun& sr,
-       std::unordered_map<hepnos::EventNumber,hepnos::Event>& createdEvents,
-       hid_t hdf_file, hepnos::WriteBatch& wb)
+static std::unique_ptr<DecodedTable> read_table(hid_t hdf_file, const std::string& product_name,
+                                                uint64_t begin_row, uint64_t end_row)
 {
-    spdlog::debug("Processing table {}", hepnos::demangle<T>());
+    spdlog::debug("Reading table {}", hepnos::demangle<T>());
+    int product = g_profiler.product_index(product_name);
+    bool pooled = use_buffer_pools<T>();
     std::vector<unsigned> events;
-    std::vector<unsigned> subruns;
     std::vector<T> table;
+    if(pooled) {
+        events = events_pool().acquire();
+        table  = table_pool<T>().acquire();
+    }
 
     spdlog::debug("Reading HDF5 file...");
-    std::tie(std::ignore, subruns, events, table) = T::from_hdf5(hdf_file);
+    {
+        auto hdf5_lock = lock_hdf5();
+        Profiler::Timer timer(g_profiler, Profiler::READ, product);
+        from_hdf5_into(hdf_file, events, table);
+    }
+    g_profiler.add(Profiler::READ, product, Profiler::ROWS, table.size());
+    g_profiler.add(Profiler::READ, product, Profiler::ROW_BYTES, table.size()*sizeof(T));
     spdlog::debug("Done HDF5 reading file");
 
-    auto batch_begin = events.cbegin();
-    auto checkeve = [](uint64_t i, uint64_t j) { return (i != j); };
-    auto batch_end = std::adjacent_find(batch_begin, events.cend(), checkeve);
-
-    size_t subrun_events = 0;
-
-    while (batch_begin != events.cend()) {
-        if (batch_end != events.cend())
-            batch_end = batch_end + 1;
-        hepnos::Event ev;
-        if(not g_simulate) {
-            auto it = createdEvents.find(*batch_begin);
-            if(it == createdEvents.end()) {
-                ev = sr.createEvent(wb, *batch_begin);
-                g_total_events += 1;
-                subrun_events += 1;
-                createdEvents[*batch_begin] = ev;
-            } else {
-                ev = it->second;
+    // Rows of the same event must be contiguous, otherwise they would
+    // be stored as several products
+    if(EventIndex::sort_rows(events, table))
+        spdlog::warn("Event column of table {} is not sorted, rows were reordered",
+                     hepnos::demangle<T>());
+
+    size_t first_row, last_row;
+    align_rows(events, begin_row, end_row, first_row, last_row);
+
+    return std::unique_ptr<DecodedTable>(
+        new DecodedTableImpl<T>(product, std::move(events), std::move(table), first_row, last_row, pooled));
+}
+
+/**
+ * Reads rows [begin_row, end_row) of a table (aligned on events) by
+ * slicing them out of the file, in chunks bounded by --memory-limit if
+ * bounded, in a single chunk otherwise. Tables whose event column is not
+ * sorted cannot be sliced and are read entirely.
+ */
+template <typename T>
+static void stream_table(hid_t hdf_file, const std::string& product_name,
+                         uint64_t begin_row, uint64_t end_row, const TableConsumer& consume,
+                         bool bounded = true)
+{
+    std::string group = Manifest::hdf5_group_name(product_name);
+    int product = g_profiler.product_index(product_name);
+    // The event column and the buffer used to copy slices are only
+    // needed while streaming, they can always come from the pools
+    std::vector<unsigned> events;
+    std::vector<char> slice_buffer;
+    if(g_reuse_buffers) {
+        events = events_pool().acquire();
+        slice_buffer = BufferPool<char>::instance("slices").acquire();
+    }
+    auto release_buffers = [&]() {
+        if(!g_reuse_buffers) return;
+        events_pool().release(std::move(events));
+        BufferPool<char>::instance("slices").release(std::move(slice_buffer));
+    };
+    size_t row_size;
+    {
+        auto hdf5_lock = lock_hdf5();
+        Profiler::Timer timer(g_profiler, Profiler::READ, product);
+        TableSlicer::read_events(hdf_file, group, events);
+        row_size = TableSlicer::row_size(hdf_file, group);
+    }
+    // Chunks must not split events, which requires the event column to be sorted
+    if(events.empty() || row_size == 0 || !std::is_sorted(events.begin(), events.end())) {
+        spdlog::debug("Table {} cannot be streamed, reading it entirely", product_name);
+        release_buffers();
+        consume(read_table<T>(hdf_file, product_name, begin_row, end_row));
+        return;
+    }
+    size_t first_row, last_row;
+    align_rows(events, begin_row, end_row, first_row, last_row);
+
+    size_t chunk_rows = bounded ? max_chunk_rows(row_size) : std::max<size_t>(1, last_row - first_row);
+    spdlog::debug("Streaming table {} in chunks of {} rows", product_name, chunk_rows);
+    size_t chunk_begin = first_row;
+    while(chunk_begin < last_row) {
+        size_t chunk_end = std::min(chunk_begin + chunk_rows, last_row);
+        while(chunk_end < last_row && events[chunk_end] == events[chunk_end-1])
+            chunk_end += 1;
+        bool pooled = use_buffer_pools<T>();
+        std::vector<unsigned> chunk_events;
+        std::vector<T> chunk_table;
+        if(pooled) {
+            chunk_events = events_pool().acquire();
+            chunk_table  = table_pool<T>().acquire();
+        }
+        {
+            auto hdf5_lock = lock_hdf5();
+            Profiler::Timer timer(g_profiler, Profiler::READ, product);
+            hid_t slice = TableSlicer::slice(hdf_file, group, chunk_begin, chunk_end,
+                                             H5P_DEFAULT, &slice_buffer);
+            if(slice < 0) {
+                spdlog::critical("Could not read rows {} to {} of table {}",
+                                 chunk_begin, chunk_end, product_name);
+                MPI_Abort(MPI_COMM_WORLD, -1);
             }
+            from_hdf5_into(slice, chunk_events, chunk_table);
+            H5Fclose(slice);
+        }
+        size_t num_rows = chunk_events.size();
+        g_profiler.add(Profiler::READ, product, Profiler::ROWS, num_rows);
+        g_profiler.add(Profiler::READ, product, Profiler::ROW_BYTES, num_rows*sizeof(T));
+        consume(std::unique_ptr<DecodedTable>(
+            new DecodedTableImpl<T>(product, std::move(chunk_events), std::move(chunk_table), 0, num_rows, pooled)));
+        chunk_begin = chunk_end;
+    }
+    release_buffers();
+}
+
+template <typename T>
+static void load_table(hid_t hdf_file, const std::string& product_name,
+                       uint64_t begin_row, uint64_t end_row, const TableConsumer& consume)
+{
+    if(g_streaming)
+        stream_table<T>(hdf_file, product_name, begin_row, end_row, consume);
+    else if(begin_row > 0 || end_row > 0)
+        // A range of rows (--rows-per-unit) only reads its own rows
+        stream_table<T>(hdf_file, product_name, begin_row, end_row, consume, false);
+    else
+        consume(read_table<T>(hdf_file, product_name, begin_row, end_row));
+}
+
+template <typename T>
+static void load_table_share(hid_t hdf_file, const std::string& product_name,
+                             MPI_Comm comm, hid_t dxpl, const TableConsumer& consume)
+{
+    // The file is opened by all the processes of comm, each of which reads
+    // a contiguous, event-aligned share of the rows of the table. Reads are
+    // collective, so all the processes must slice the same datasets.
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    std::string group = Manifest::hdf5_group_name(product_name);
+    int product = g_profiler.product_index(product_name);
+    {
+        auto hdf5_lock = lock_hdf5();
+        if(TableSlicer::row_size(hdf_file, group) == 0) return;
+    }
+    bool pooled = use_buffer_pools<T>();
+    std::vector<unsigned> events;
+    std::vector<T> table;
+    if(pooled) {
+        events = events_pool().acquire();
+        table  = table_pool<T>().acquire();
+    }
+    {
+        auto hdf5_lock = lock_hdf5();
+        Profiler::Timer timer(g_profiler, Profiler::READ, product);
+        TableSlicer::read_events(hdf_file, group, events);
+        // Shares cannot be event-aligned if the event column is not
+        // sorted, in which case the first process reads everything
+        size_t num_rows = events.size();
+        size_t first_row = 0, last_row = 0;
+        if(std::is_sorted(events.begin(), events.end())) {
+            uint64_t begin_row = num_rows * rank / size;
+            uint64_t end_row   = num_rows * (rank + 1) / size;
+            if(end_row > begin_row)
+                align_rows(events, begin_row, end_row, first_row, last_row);
+        } else if(rank == 0) {
+            last_row = num_rows;
+        }
+        hid_t slice = TableSlicer::slice(hdf_file, group, first_row, last_row, dxpl);
+        if(slice < 0) {
+            spdlog::critical("Could not read rows {} to {} of table {}", first_row, last_row, product_name);
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+        from_hdf5_into(slice, events, table);
+        H5Fclose(slice);
+    }
+    g_profiler.add(Profiler::READ, product, Profiler::ROWS, table.size());
+    g_profiler.add(Profiler::READ, product, Profiler::ROW_BYTES, table.size()*sizeof(T));
+    if(EventIndex::sort_rows(events, table))
+        spdlog::warn("Event column of table {} is not sorted, rows were reordered",
+                     hepnos::demangle<T>());
+    size_t num_rows = events.size();
+    consume(std::unique_ptr<DecodedTable>(
+        new DecodedTableImpl<T>(product, std::move(events), std::move(table), 0, num_rows, pooled)));
+}
+
+/**
+ * With --raw-layout, the products of trivially copyable types are stored
+ * as RawProducts, which cannot be instantiated for the other types.
+ */
+template <typename T>
+static bool preload_raw_product(hepnos::ParallelEventProcessor&, std::false_type) {
+    return false;
+}
+
+template <typename T>
+static bool preload_raw_product(hepnos::ParallelEventProcessor& pep, std::true_type) {
+    pep.preload<RawProduct<T>>(g_product_label);
+    return true;
+}
+
+template <typename T>
+static bool load_raw_product(const hepnos::Event&, const hepnos::ProductCache&,
+                             const std::string&, bool&, uint64_t&, std::false_type) {
+    return false;
+}
+
+template <typename T>
+static bool load_raw_product(const hepnos::Event& event, const hepnos::ProductCache& cache,
+                             const std::string& product_name, bool& found, uint64_t& rows, std::true_type) {
+    RawProduct<T> product;
+    found = event.load(cache, g_product_label, product);
+    if(found && !product.valid()) {
+        spdlog::error("Product {} of event {} was stored with another layout", product_name, event.number());
+        found = false;
+    }
+    rows = product.loaded.size();
+    return true;
+}
+
+template <typename T>
+static void preload_product(hepnos::ParallelEventProcessor& pep, const std::string& product_name) {
+    if(g_product_compression.count(product_name))
+        pep.preload<CompressedProduct<T>>(g_product_label);
+    else if(!(g_raw_layout && preload_raw_product<T>(pep, std::is_trivially_copyable<T>())))
+        pep.preload<std::vector<T>>(g_product_label);
+}
+
+template <typename T>
+static bool load_product(const hepnos::Event& event, const hepnos::ProductCache& cache,
+                         const std::string& product_name, uint64_t& rows) {
+    std::vector<T> table;
+    bool found = false;
+    if(g_product_compression.count(product_name)) {
+        CompressedProduct<T> product;
+        if(!event.load(cache, g_product_label, product)) return false;
+        if(!product.decompress(table)) {
+            spdlog::error("Could not decompress product {} of event {}", product_name, event.number());
+            return false;
         }
-        size_t b_idx = batch_begin - events.cbegin();
-        size_t e_idx = batch_end - events.cbegin();
-        g_total_products += 1;
-        if(not g_simulate)
-            ev.store(wb, g_product_label, table, b_idx, e_idx);
-        batch_begin = batch_end;
-        batch_end = std::adjacent_find(batch_begin, events.cend(), checkeve);
+    } else if(g_raw_layout && load_raw_product<T>(event, cache, product_name, found, rows,
+                                                  std::is_trivially_copyable<T>())) {
+        return found;
+    } else if(!event.load(cache, g_product_label, table)) {
+        return false;
     }
-    spdlog::debug("Done processing table {}", hepnos::demangle<T>());
-    spdlog::debug("Created {} new events in subrun {}, run {}", subrun_events, sr.number(), sr.run().number());
+    rows = table.size();
+    return true;
 }
 
 static uint64_t parse_num_from_filename(const std::string& filename, const std::regex& r) {
@@ -335,71 +1722,556 @@ static uint64_t parse_num_from_filename(const std::string& filename, const std::
     return -1;
 }
 
+static SubRunCache::Key subrun_of_file(const std::string& filename) {
+    // Compiled once, matching with a const regex is thread-safe
+    static const std::regex run_regex("(_r000)([0-9]{5})");
+    static const std::regex subrun_regex("(_s)([0-9]{2})");
+    hepnos::RunNumber run = parse_num_from_filename(filename, run_regex) + g_run_offset;
+    hepnos::SubRunNumber subrun = parse_num_from_filename(filename, subrun_regex);
+    return SubRunCache::Key(run, subrun);
+}
+
+static void create_subruns(const std::vector<std::string>& input_files, hepnos::DataStore& datastore,
+                           SubRunCache& cache) {
+    // Rank 0 finds the distinct runs and subruns of the input files
+    std::vector<uint64_t> numbers;
+    if(g_rank == 0) {
+        std::set<SubRunCache::Key> keys;
+        for(auto& filename : input_files) keys.insert(subrun_of_file(filename));
+        for(auto& key : keys) {
+            numbers.push_back(key.first);
+            numbers.push_back(key.second);
+        }
+    }
+    uint64_t count = numbers.size();
+    MPI_Bcast(&count, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+    numbers.resize(count);
+    MPI_Bcast(numbers.data(), count, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+    // Each process creates a contiguous share of them, so that
+    // few runs are created by more than one process
+    size_t num_subruns = count / 2;
+    std::vector<SubRunCache::Key> all_keys, keys;
+    for(size_t i = 0; i < num_subruns; i++)
+        all_keys.emplace_back(numbers[2*i], numbers[2*i+1]);
+    keys.assign(all_keys.begin() + num_subruns * g_rank / g_size,
+                all_keys.begin() + num_subruns * (g_rank + 1) / g_size);
+    hepnos::WriteBatch batch(datastore, std::max<size_t>(1, 2*keys.size()));
+    cache.create(keys, batch);
+    batch.flush();
+    // Everything must exist before events are stored in the subruns
+    MPI_Barrier(MPI_COMM_WORLD);
+    // Any process may load any file, so each one needs the handles
+    // of the subruns created by the others, flushed before it stores
+    // events in them
+    hepnos::WriteBatch open_batch(datastore, std::max<size_t>(1, 2*(num_subruns - keys.size())));
+    cache.open(all_keys, open_batch);
+    open_batch.flush();
+    if(g_rank == 0) spdlog::info("Created {} subruns", num_subruns);
+}
+
 static void prepare_product_loading_functions() {
     spdlog::trace("Preparing functions for loading producs");
 #define X(__class__) \
-    g_load_product_fn[#__class__] = &process_table<__class__>;
+    g_load_product_fn[#__class__] = &load_table<__class__>; \
+    g_load_product_share_fn[#__class__] = &load_table_share<__class__>; \
+    g_read_product_fn[#__class__] = ProductReader{ &preload_product<__class__>, \
+        &load_product<__class__>, sizeof(__class__) }; \
+    g_product_poolable[#__class__] = has_from_hdf5_into<__class__>::value;
     HEPNOS_FOREACH_NOVA_CLASS
 #undef X
     spdlog::trace("Created functions for {} product types", g_load_product_fn.size());
 }
 
-static void process_hdf5_file(hepnos::DataSet& dataset,
-        const std::string& filename, hepnos::WriteBatch& writeBatch) {
+static std::unique_lock<tl::mutex> lock_hdf5() {
+#ifdef H5_HAVE_THREADSAFE
+    return std::unique_lock<tl::mutex>(g_hdf5_mtx, std::defer_lock);
+#else
+    return std::unique_lock<tl::mutex>(g_hdf5_mtx);
+#endif
+}
 
-    spdlog::info("Starting file {}", filename);
+static void prefetch_file(const std::string& filename) {
+    // Ask the OS to start reading the file in the background so that
+    // it is in the page cache by the time we open it with HDF5
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+    spdlog::debug("Prefetching file {}", filename);
+}
 
-    hid_t hdf_file = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+static hid_t open_hdf5_file(const WorkUnit& unit, bool& in_memory) {
+    const std::string& filename = unit.filename;
+    if(unit.is_whole_file())
+        spdlog::info("Starting file {}", filename);
+    else
+        spdlog::info("Starting file {} (product {}, rows {} to {})",
+                     filename, unit.product, unit.begin, unit.end);
+    Profiler::Timer timer(g_profiler, Profiler::OPEN);
+    in_memory = false;
+    std::vector<char> image;
+    if(g_memory_image_threshold > 0) {
+        // Without a manifest, the size is only known once the file is opened
+        auto known = g_file_sizes.find(filename);
+        if(known == g_file_sizes.end() || known->second <= g_memory_image_threshold)
+            in_memory = read_file_image(filename, image);
+    }
+    auto hdf5_lock = lock_hdf5();
+    if(!in_memory)
+        return H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+    // The core driver opens the file from its image, after which
+    // metadata and tables are read from memory
+    hid_t fapl = H5Pcreate(H5P_FILE_ACCESS);
+    H5Pset_fapl_core(fapl, 1024*1024, 0);
+    H5Pset_file_image(fapl, image.data(), image.size());
+    hid_t hdf_file = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, fapl);
+    H5Pclose(fapl);
+    spdlog::debug("Opened file {} from memory", filename);
+    return hdf_file;
+}
 
-    hepnos::RunNumber runNumber = parse_num_from_filename(filename, std::regex("(_r000)([0-9]{5})"));
-    runNumber += g_run_offset;
-    hepnos::SubRunNumber subrunNumber = parse_num_from_filename(filename, std::regex("(_s)([0-9]{2})"));
-    spdlog::debug("Creating run {} and subrun {}", runNumber, subrunNumber);
+/**
+ * Reads a whole file with large sequential reads if it is not larger than
+ * --memory-image-threshold, using the size of the opened descriptor rather
+ * than a separate stat(). Returns false if the file is larger or unreadable.
+ */
+static bool read_file_image(const std::string& filename, std::vector<char>& image) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0 || (uint64_t)st.st_size > g_memory_image_threshold) {
+        close(fd);
+        return false;
+    }
+    image.resize(st.st_size);
+    size_t done = 0;
+    while(done < image.size()) {
+        ssize_t n = read(fd, image.data() + done, image.size() - done);
+        if(n <= 0) break;
+        done += n;
+    }
+    close(fd);
+    return done == image.size();
+}
 
-    hepnos::Run r;
-    hepnos::SubRun sr;
+/**
+ * Rank 0 sends the sizes of the input files it found in the manifest to
+ * all the processes, so that they do not need to stat() them.
+ */
+static void share_file_sizes(const std::vector<std::string>& input_files, const Manifest& manifest) {
+    std::string sizes;
+    if(g_rank == 0) {
+        for(auto& filename : input_files) {
+            auto info = manifest.find(filename);
+            if(!info) continue;
+            sizes += std::to_string(info->size) + '\t' + filename + '\n';
+        }
+    }
+    uint64_t sizes_size = sizes.size();
+    MPI_Bcast(&sizes_size, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+    sizes.resize(sizes_size);
+    MPI_Bcast(const_cast<char*>(sizes.data()), sizes_size, MPI_CHAR, 0, MPI_COMM_WORLD);
+    std::stringstream ss(sizes);
+    std::string size, filename;
+    while(std::getline(ss, size, '\t') && std::getline(ss, filename))
+        g_file_sizes[filename] = std::stoull(size);
+}
 
-    if(not g_simulate) {
-        r = dataset.createRun(runNumber);
-        sr = r.createSubRun(subrunNumber);
+static void close_hdf5_file(const WorkUnit& unit, hid_t hdf_file) {
+    {
+        auto hdf5_lock = lock_hdf5();
+        Profiler::Timer timer(g_profiler, Profiler::CLOSE);
+        H5Fclose(hdf_file);
     }
+    spdlog::info("Done with file {}", unit.filename);
+}
+
+static void begin_subrun(OutputSink& sink, const std::string& filename) {
+    auto key = subrun_of_file(filename);
+    hepnos::RunNumber runNumber = key.first;
+    hepnos::SubRunNumber subrunNumber = key.second;
+    spdlog::debug("Creating run {} and subrun {}", runNumber, subrunNumber);
 
-    std::unordered_map<hepnos::EventNumber,hepnos::Event> createdEvents;
+    if(not g_simulate) sink.begin_subrun(runNumber, subrunNumber);
 
     spdlog::debug("Done creating/accessing run/subrun");
-    spdlog::debug("Created {} events in run {} subrun {}",
-                  createdEvents.size(), runNumber, subrunNumber);
-
-    for(auto& product_name : g_product_names) {
-        g_load_product_fn[product_name](sr, createdEvents, hdf_file, writeBatch);
-    }
-
-#if 0
-    process_table<hep::rec_hdr>(sr, createdEvents, hdf_file, writeBatch);
-    process_table<hep::rec_slc>(sr, createdEvents, hdf_file, writeBatch);
-    process_table<hep::rec_vtx>(sr, createdEvents, hdf_file, writeBatch);
-    process_table<hep::rec_vtx_elastic_fuzzyk>(sr, createdEvents, hdf_file, writeBatch);
-    process_table<hep::rec_vtx_elastic_fuzzyk_png>(sr, createdEvents, hdf_file, writeBatch);
-    process_table<hep::rec_vtx_elastic_fuzzyk_png_shwlid>(sr, createdEvents, hdf_file, writeBatch);
-    process_table<hep::rec_vtx_elastic_fuzzyk_png_cvnpart>(sr, createdEvents, hdf_file, writeBatch);
-    process_table<hep::rec_sel_contain>(sr, createdEvents, hdf_file, writeBatch);
-    process_table<hep::rec_sel_cvn2017>(sr, createdEvents, hdf_file, writeBatch);
-    process_table<hep::rec_sel_cvnProd3Train>(sr, createdEvents, hdf_file, writeBatch);
-    process_table<hep::rec_sel_remid>(sr, createdEvents, hdf_file, writeBatch);
-    process_table<hep::rec_spill>(sr, createdEvents, hdf_file, writeBatch);
-    process_table<hep::rec_trk_cosmic>(sr, createdEvents, hdf_file, writeBatch);
-    process_table<hep::rec_trk_kalman>(sr, createdEvents, hdf_file, writeBatch);
-    process_table<hep::rec_trk_kalman_tracks>(sr, createdEvents, hdf_file, writeBatch);
-    process_table<hep::rec_energy_numu>(sr, createdEvents, hdf_file, writeBatch);
-#endif
+}
+
+static bool flush_output(OutputSink& sink) {
+    if(g_simulate) return false;
+    spdlog::debug("Flushing output...");
+    Profiler::Timer timer(g_profiler, Profiler::FLUSH);
+    bool flushed = sink.flush();
+    spdlog::debug("Done flushing");
+    return flushed;
+}
+
+static void read_hdf5_file(const WorkUnit& unit, const TableConsumer& consume) {
+    auto start = FileIOStatistics::now();
+    double t_start = MPI_Wtime();
+    double consume_time = 0.0;
+    auto timed_consume = [&](std::unique_ptr<DecodedTable> table) {
+        double t = MPI_Wtime();
+        consume(std::move(table));
+        consume_time += MPI_Wtime() - t;
+    };
+    bool in_memory;
+    hid_t hdf_file = open_hdf5_file(unit, in_memory);
+    if(unit.is_whole_file()) {
+        for(auto& product_name : g_product_names) {
+            g_load_product_fn[product_name](hdf_file, product_name, 0, 0, timed_consume);
+        }
+    } else {
+        g_load_product_fn[unit.product](hdf_file, unit.product, unit.begin, unit.end, timed_consume);
+    }
+    close_hdf5_file(unit, hdf_file);
+    auto end = FileIOStatistics::now();
+    std::unique_lock<tl::mutex> lock(g_file_io_stats_mtx);
+    auto& stats = g_file_io_stats[in_memory];
+    stats.files      += 1;
+    stats.read_calls += end.read_calls - start.read_calls;
+    stats.read_bytes += end.read_bytes - start.read_bytes;
+    stats.time       += MPI_Wtime() - t_start - consume_time;
+}
 
-    if((not g_simulate) && (not g_use_async)) {
-        spdlog::info("Flushing data from WriteBatch...");
-        writeBatch.flush();
-        spdlog::info("Done flushing");
+static std::vector<std::string> split_collective_files(std::vector<std::string>& input_files,
+                                                       const Manifest& manifest, MPI_Comm& group_comm) {
+    // Rank 0 takes the large files out of the list of input files
+    std::string large_files;
+    if(g_rank == 0) {
+        std::vector<std::string> small_files;
+        for(auto& filename : input_files) {
+            // Sizes come from the manifest when there is one
+            Manifest::FileInfo info;
+            info.filename = filename;
+            auto known = manifest.find(filename);
+            if(known) info.size = known->size;
+            if((known || Manifest::stat_file(info)) && info.size >= g_collective_threshold) {
+                large_files += filename;
+                large_files += '\n';
+            } else {
+                small_files.push_back(filename);
+            }
+        }
+        spdlog::info("{} files will be read collectively", input_files.size() - small_files.size());
+        input_files = std::move(small_files);
     }
+    uint64_t large_files_size = large_files.size();
+    MPI_Bcast(&large_files_size, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+    large_files.resize(large_files_size);
+    MPI_Bcast(const_cast<char*>(large_files.data()), large_files_size, MPI_CHAR, 0, MPI_COMM_WORLD);
+    // Processes are split into groups of consecutive ranks,
+    // to which files are assigned in a round-robin manner
+    int group_size = std::min(g_collective_group, g_size);
+    int num_groups = (g_size + group_size - 1) / group_size;
+    int group = g_rank / group_size;
+    MPI_Comm_split(MPI_COMM_WORLD, group, g_rank, &group_comm);
+    std::vector<std::string> group_files;
+    std::stringstream ss(large_files);
+    std::string filename;
+    size_t i = 0;
+    while(std::getline(ss, filename)) {
+        if((int)(i % num_groups) == group) group_files.push_back(filename);
+        i += 1;
+    }
+    return group_files;
+}
 
-    H5Fclose(hdf_file);
+static void read_hdf5_file_collective(const std::string& filename, MPI_Comm comm,
+                                      const TableConsumer& consume) {
+#ifdef H5_HAVE_PARALLEL
+    spdlog::info("Starting file {} (collective)", filename);
+    hid_t fapl, dxpl, hdf_file;
+    {
+        auto hdf5_lock = lock_hdf5();
+        Profiler::Timer timer(g_profiler, Profiler::OPEN);
+        fapl = H5Pcreate(H5P_FILE_ACCESS);
+        H5Pset_fapl_mpio(fapl, comm, MPI_INFO_NULL);
+        hdf_file = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, fapl);
+        H5Pclose(fapl);
+        dxpl = H5Pcreate(H5P_DATASET_XFER);
+        H5Pset_dxpl_mpio(dxpl, H5FD_MPIO_COLLECTIVE);
+    }
+    if(hdf_file < 0) {
+        spdlog::critical("Could not open file {} with MPI-IO", filename);
+        MPI_Abort(MPI_COMM_WORLD, -1);
+    }
+    for(auto& product_name : g_product_names)
+        g_load_product_share_fn[product_name](hdf_file, product_name, comm, dxpl, consume);
+    {
+        auto hdf5_lock = lock_hdf5();
+        Profiler::Timer timer(g_profiler, Profiler::CLOSE);
+        H5Pclose(dxpl);
+        H5Fclose(hdf_file);
+    }
     spdlog::info("Done with file {}", filename);
+#else
+    // --collective-threshold is reset without MPI-IO support
+    (void)filename;
+    (void)comm;
+    (void)consume;
+#endif
+}
+
+static void process_hdf5_file(const WorkUnit& unit, OutputSink& sink, const TableConsumer& store) {
+
+    begin_subrun(sink, unit.filename);
+
+    // Tables (or chunks of tables with --streaming) are stored as soon
+    // as they are read, so that only one is in memory at any time
+    read_hdf5_file(unit, store);
 }
 
+static void report_allocations() {
+    // Number of buffers each pool handed out and how many were reused
+    uint64_t acquired = 0, reused = 0;
+    for(auto pool : BufferPoolBase::pools()) {
+        auto stats = pool->statistics();
+        acquired += stats.acquired;
+        reused   += stats.reused;
+        spdlog::info("Buffer pool {}: {} buffers acquired, {} reused, largest {} bytes",
+                     pool->name(), stats.acquired, stats.reused, stats.max_bytes);
+    }
+    uint64_t local[3] = { g_num_allocations.load(), acquired, reused };
+    uint64_t total[3] = { 0, 0, 0 };
+    MPI_Reduce(local, total, 3, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+#ifdef DATALOADER_COUNT_ALLOCATIONS
+    spdlog::info("Allocations: {}", local[0]);
+    std::string allocations = std::to_string(total[0]);
+#else
+    std::string allocations = "n/a";
+#endif
+    if(g_rank == 0) {
+        std::cout << "ALLOCATIONS: " << allocations << " BUFFERS REUSED: "
+                  << total[2] << "/" << total[1] << std::endl;
+    }
+}
+
+/**
+ * Gathers the counts of all the processes at rank 0, adding up
+ * those of the same subrun.
+ */
+static void gather_counts(SubRunCounts& counts, size_t width) {
+    std::vector<uint64_t> local;
+    for(auto& entry : counts) {
+        local.push_back(entry.first.first);
+        local.push_back(entry.first.second);
+        local.insert(local.end(), entry.second.begin(), entry.second.end());
+    }
+    int local_size = local.size();
+    std::vector<int> sizes(g_size), offsets(g_size);
+    MPI_Gather(&local_size, 1, MPI_INT, sizes.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+    std::vector<uint64_t> all;
+    if(g_rank == 0) {
+        int total = 0;
+        for(int r = 0; r < g_size; r++) {
+            offsets[r] = total;
+            total += sizes[r];
+        }
+        all.resize(total);
+    }
+    MPI_Gatherv(local.data(), local_size, MPI_UINT64_T, all.data(), sizes.data(), offsets.data(),
+                MPI_UINT64_T, 0, MPI_COMM_WORLD);
+    if(g_rank != 0) return;
+    counts.clear();
+    for(size_t i = 0; i + 2 + width <= all.size(); i += 2 + width) {
+        auto& c = counts[SubRunCache::Key(all[i], all[i+1])];
+        c.resize(width);
+        for(size_t j = 0; j < width; j++) c[j] += all[i+2+j];
+    }
+}
+
+/**
+ * Counts the events, products and rows that loading the input files
+ * creates in each subrun, each process reading the event numbers of
+ * a share of the files.
+ */
+static SubRunCounts count_input_subruns(const std::vector<std::string>& input_files) {
+    size_t width = 1 + 2*g_product_names.size();
+    // All the files of a subrun are counted by the same process, since
+    // events are only stored once per subrun even if several files hold them
+    std::map<SubRunCache::Key, std::vector<std::string>> subrun_files;
+    for(auto& filename : input_files) subrun_files[subrun_of_file(filename)].push_back(filename);
+    SubRunCounts counts;
+    std::vector<unsigned> events;
+    size_t i = 0;
+    for(auto& entry : subrun_files) {
+        if((int)(i++ % g_size) != g_rank) continue;
+        auto& c = counts[entry.first];
+        c.resize(width);
+        // Tables are sorted by event when stored, so that each distinct
+        // event of a table becomes exactly one product
+        std::set<unsigned> subrun_events;
+        std::vector<std::set<unsigned>> product_events(g_product_names.size());
+        for(auto& filename : entry.second) {
+            hid_t hdf_file = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+            if(hdf_file < 0) {
+                spdlog::error("Could not open file {}", filename);
+                continue;
+            }
+            for(size_t p = 0; p < g_product_names.size(); p++) {
+                TableSlicer::read_events(hdf_file, Manifest::hdf5_group_name(g_product_names[p]), events);
+                product_events[p].insert(events.begin(), events.end());
+                c[2+2*p] += events.size();
+            }
+            H5Fclose(hdf_file);
+        }
+        for(size_t p = 0; p < g_product_names.size(); p++) {
+            c[1+2*p] = product_events[p].size();
+            subrun_events.insert(product_events[p].begin(), product_events[p].end());
+        }
+        c[0] = subrun_events.size();
+    }
+    gather_counts(counts, width);
+    return counts;
+}
+
+static bool verify_dataset(hepnos::DataStore& datastore, std::vector<std::string>& input_files) {
+    size_t width = 1 + 2*g_product_names.size();
+    // The list of input files is broadcast to everyone
+    std::string files;
+    for(auto& filename : input_files) {
+        files += filename;
+        files += '\n';
+    }
+    uint64_t files_size = files.size();
+    MPI_Bcast(&files_size, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+    files.resize(files_size);
+    MPI_Bcast(const_cast<char*>(files.data()), files_size, MPI_CHAR, 0, MPI_COMM_WORLD);
+    input_files.clear();
+    std::stringstream ss(files);
+    std::string filename;
+    while(std::getline(ss, filename)) input_files.push_back(filename);
+
+    spdlog::info("Counting events and products of {} input files", input_files.size());
+    auto expected = count_input_subruns(input_files);
+
+    hepnos::DataSet dataset;
+    try {
+        dataset = datastore.root()[g_output_dataset];
+    } catch(const hepnos::Exception& ex) {
+        spdlog::critical("Could not open dataset {}: {}", g_output_dataset, ex.what());
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    // Every event of the dataset is processed once by one of the processes,
+    // its products being loaded in batches by the ParallelEventProcessor
+    hepnos::ParallelEventProcessorOptions options;
+    if(g_batch_size > 0) {
+        options.input_batch_size  = g_batch_size;
+        options.output_batch_size = g_batch_size;
+    }
+    hepnos::ParallelEventProcessor pep(datastore, MPI_COMM_WORLD, options);
+    for(auto& product_name : g_product_names)
+        g_read_product_fn[product_name].preload(pep, product_name);
+    SubRunCounts found;
+    uint64_t local_bytes = 0;
+    tl::mutex found_mtx;
+    hepnos::ParallelEventProcessorStatistics stats;
+    spdlog::info("Reading back dataset {}", g_output_dataset);
+    MPI_Barrier(MPI_COMM_WORLD);
+    double t_start = MPI_Wtime();
+    pep.process(dataset, [&](const hepnos::Event& event, const hepnos::ProductCache& cache) {
+        std::vector<uint64_t> c(width);
+        uint64_t bytes = 0;
+        c[0] = 1;
+        for(size_t p = 0; p < g_product_names.size(); p++) {
+            auto& reader = g_read_product_fn[g_product_names[p]];
+            uint64_t rows = 0;
+            if(!reader.load(event, cache, g_product_names[p], rows)) continue;
+            c[1+2*p] += 1;
+            c[2+2*p] += rows;
+            bytes += rows*reader.row_size; // in-memory size of the rows, not the serialized size
+        }
+        auto subrun = event.subrun();
+        SubRunCache::Key key(subrun.run().number(), subrun.number());
+        std::unique_lock<tl::mutex> lock(found_mtx);
+        auto& total = found[key];
+        total.resize(width);
+        for(size_t j = 0; j < width; j++) total[j] += c[j];
+        local_bytes += bytes;
+    }, &stats);
+    double local_time = MPI_Wtime() - t_start;
+    spdlog::info("Read back {} events: {}", stats.local_events_processed, stats);
+
+    double time = 0;
+    uint64_t bytes = 0;
+    MPI_Reduce(&local_time, &time, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&local_bytes, &bytes, 1, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+    gather_counts(found, width);
+
+    // Rank 0 compares the counts of each subrun
+    bool ok = true;
+    if(g_rank == 0) {
+        std::vector<uint64_t> total_expected(width), total_found(width);
+        std::set<SubRunCache::Key> keys;
+        for(auto& entry : expected) keys.insert(entry.first);
+        for(auto& entry : found) keys.insert(entry.first);
+        size_t num_mismatched = 0;
+        for(auto& key : keys) {
+            auto& e = expected[key];
+            auto& f = found[key];
+            e.resize(width);
+            f.resize(width);
+            for(size_t j = 0; j < width; j++) {
+                total_expected[j] += e[j];
+                total_found[j]    += f[j];
+            }
+            if(e == f) continue;
+            num_mismatched += 1;
+            if(e[0] != f[0])
+                spdlog::error("Run {} subrun {}: {} events expected, {} found",
+                              key.first, key.second, e[0], f[0]);
+            for(size_t p = 0; p < g_product_names.size(); p++) {
+                if(e[1+2*p] == f[1+2*p] && e[2+2*p] == f[2+2*p]) continue;
+                spdlog::error("Run {} subrun {}: {} products ({} rows) of {} expected, {} ({} rows) found",
+                              key.first, key.second, e[1+2*p], e[2+2*p], g_product_names[p],
+                              f[1+2*p], f[2+2*p]);
+            }
+        }
+        ok = num_mismatched == 0;
+        uint64_t products_expected = 0, products_found = 0;
+        for(size_t p = 0; p < g_product_names.size(); p++) {
+            products_expected += total_expected[1+2*p];
+            products_found    += total_found[1+2*p];
+        }
+        std::cout << "VERIFY: " << (ok ? "OK" : "FAILED") << " SUBRUNS: " << keys.size() - num_mismatched
+                  << "/" << keys.size() << " EVENTS: " << total_found[0] << "/" << total_expected[0]
+                  << " PRODUCTS: " << products_found << "/" << products_expected << std::endl;
+        std::cout << "READ TIME: " << time << " EVENTS/S: " << total_found[0]/time
+                  << " ROW MB/S: " << bytes/(1024.0*1024.0)/time << std::endl;
+    }
+    int result = ok;
+    MPI_Bcast(&result, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    return result;
+}
+
+static void report_file_io() {
+    FileIOStatistics total[2];
+    MPI_Reduce(g_file_io_stats, total, 2*sizeof(FileIOStatistics)/sizeof(double), MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    if(g_rank != 0) return;
+    const char* kinds[2] = { "DIRECT", "MEMORY IMAGE" };
+    for(int i = 0; i < 2; i++) {
+        auto& t = total[i];
+        if(t.files == 0) continue;
+        std::cout << "FILE IO (" << kinds[i] << "): FILES " << t.files
+                  << " READ CALLS PER FILE " << t.read_calls/t.files
+                  << " MB PER FILE " << t.read_bytes/(1024*1024)/t.files
+                  << " TIME PER FILE " << t.time/t.files << std::endl;
+    }
+}
+
+static void report_memory() {
+    auto stats = g_memory_budget.statistics();
+    spdlog::info("Memory: peak {} MB, {} stalls for {} s", stats.peak/(1024*1024), stats.stalls, stats.stall_time);
+    uint64_t local[2] = { stats.peak, stats.stalls };
+    uint64_t total[2] = { 0, 0 };
+    double total_stall_time = 0.0;
+    MPI_Reduce(&local[0], &total[0], 1, MPI_UINT64_T, MPI_MAX, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&local[1], &total[1], 1, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(&stats.stall_time, &total_stall_time, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+    if(g_rank == 0) {
+        std::cout << "MEMORY: PEAK " << total[0]/(1024.0*1024.0) << " MB BUDGET "
+                  << g_memory_budget.budget()/(1024*1024) << " MB STALLS " << total[1]
+                  << " STALL TIME " << total_stall_time << std::endl;
+    }
+}
@@ -0,0 +1,185 @@
+#ifndef __DATALOADER_DISTRIBUTED_WORK_QUEUE_H
+#define __DATALOADER_DISTRIBUTED_WORK_QUEUE_H
+
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <atomic>
+#include <memory>
+#include <mpi.h>
+#include "AbstractWorkQueue.hpp"
+
+/**
+ * Work queue without a central server. Work pushed by any process is
+ * replicated to all the processes when the queue becomes read-only.
+ * The list is then split into one shard per node, and each shard has
+ * a counter hosted by the first process of its node. Processes pull work
+ * by atomically incrementing (MPI_Fetch_and_op) the counter of their own
+ * node's shard, and steal from other shards once their own is exhausted.
+ *
+ * Contrary to WorkQueue, readonly() and the destructor are collective.
+ */
+class DistributedWorkQueue : public AbstractWorkQueue {
+
+    public:
+
+    DistributedWorkQueue(MPI_Comm comm, SchedulingPolicy policy = FIFO)
+    : m_comm(comm)
+    , m_policy(policy) {
+        MPI_Comm_rank(comm, &m_rank);
+        MPI_Comm_size(comm, &m_size);
+    }
+
+    ~DistributedWorkQueue() override {
+        if(m_is_open_for_writes) readonly();
+        MPI_Win_unlock_all(m_win);
+        MPI_Win_free(&m_win);
+    }
+
+    void start_listening() override {}
+
+    void readonly() override {
+        if(!m_is_open_for_writes) return;
+        m_is_open_for_writes = false;
+        _replicate_work();
+        _create_shards();
+    }
+
+    void push(const std::string& work, uint64_t cost = 0) override {
+        if(!m_is_open_for_writes) throw ReadOnlyQueueException();
+        m_local_work.push_back(WorkItem{work, cost});
+    }
+
+    std::string pull() override {
+        return pull_bulk(1)[0];
+    }
+
+    /**
+     * Reserves up to max_items consecutive items of a shard
+     * with a single atomic operation.
+     */
+    std::vector<std::string> pull_bulk(size_t max_items) override {
+        std::vector<std::string> result;
+        if(max_items == 0) return result;
+        size_t num_shards = m_shard_hosts.size();
+        for(size_t i = 0; i < num_shards; i++) {
+            size_t shard = (m_home_shard + i) % num_shards;
+            if(m_shard_exhausted[shard].load(std::memory_order_relaxed)) continue;
+            uint64_t count = max_items;
+            uint64_t index = 0;
+            MPI_Fetch_and_op(&count, &index, MPI_UINT64_T,
+                             m_shard_hosts[shard], 0, MPI_SUM, m_win);
+            MPI_Win_flush(m_shard_hosts[shard], m_win);
+            uint64_t shard_size = _shard_size(shard);
+            for(uint64_t j = index; j < shard_size && j < index + count; j++)
+                result.push_back(m_work[shard + j*num_shards].work);
+            if(index + count >= shard_size)
+                m_shard_exhausted[shard].store(true, std::memory_order_relaxed);
+            if(!result.empty()) return result;
+        }
+        throw EmptyQueueException();
+    }
+
+    void clear() override {
+        size_t num_shards = m_shard_hosts.size();
+        for(size_t shard = 0; shard < num_shards; shard++) {
+            uint64_t shard_size = _shard_size(shard);
+            MPI_Accumulate(&shard_size, 1, MPI_UINT64_T,
+                           m_shard_hosts[shard], 0, 1, MPI_UINT64_T,
+                           MPI_REPLACE, m_win);
+            MPI_Win_flush(m_shard_hosts[shard], m_win);
+        }
+    }
+
+    private:
+
+    struct WorkItem {
+        std::string work; // content of the work item
+        uint64_t    cost; // cost used by LONGEST_FIRST scheduling
+    };
+
+    MPI_Comm              m_comm; // communicator
+    int                   m_rank; // rank of current process
+    int                   m_size; // size of the communicator
+    SchedulingPolicy      m_policy; // order in which work is pulled
+    bool                  m_is_open_for_writes = true; // work can still be pushed
+    std::vector<WorkItem> m_local_work; // work pushed by this process
+    std::vector<WorkItem> m_work; // replicated list of all the work items
+    std::vector<int>      m_shard_hosts; // rank hosting the counter of each shard
+    std::unique_ptr<std::atomic<bool>[]> m_shard_exhausted; // shards known to be empty (set by concurrent pulls)
+    size_t                m_home_shard = 0; // shard of the node of this process
+    MPI_Win               m_win = MPI_WIN_NULL; // window exposing the shard counters
+    uint64_t*             m_counter = nullptr; // counter hosted by this process
+
+    void _replicate_work() {
+        // serialize local work as [cost, size, data] entries
+        std::string local_buffer;
+        for(auto& item : m_local_work) {
+            uint64_t header[2] = { item.cost, item.work.size() };
+            local_buffer.append(reinterpret_cast<const char*>(header), sizeof(header));
+            local_buffer.append(item.work);
+        }
+        m_local_work.clear();
+        int local_size = local_buffer.size();
+        std::vector<int> sizes(m_size), offsets(m_size);
+        MPI_Allgather(&local_size, 1, MPI_INT, sizes.data(), 1, MPI_INT, m_comm);
+        int total = 0;
+        for(int r = 0; r < m_size; r++) {
+            offsets[r] = total;
+            total += sizes[r];
+        }
+        std::string buffer(total, '\0');
+        MPI_Allgatherv(local_buffer.data(), local_size, MPI_CHAR,
+                       const_cast<char*>(buffer.data()), sizes.data(), offsets.data(),
+                       MPI_CHAR, m_comm);
+        // deserialize, the resulting order is the same in all processes
+        size_t pos = 0;
+        while(pos < buffer.size()) {
+            uint64_t header[2];
+            std::memcpy(header, buffer.data() + pos, sizeof(header));
+            pos += sizeof(header);
+            m_work.push_back(WorkItem{buffer.substr(pos, header[1]), header[0]});
+            pos += header[1];
+        }
+        if(m_policy == LONGEST_FIRST) {
+            std::stable_sort(m_work.begin(), m_work.end(),
+                [](const WorkItem& a, const WorkItem& b) { return a.cost > b.cost; });
+        }
+    }
+
+    void _create_shards() {
+        // find the rank of the first process of each node
+        MPI_Comm node_comm;
+        MPI_Comm_split_type(m_comm, MPI_COMM_TYPE_SHARED, m_rank, MPI_INFO_NULL, &node_comm);
+        int leader = m_rank;
+        MPI_Bcast(&leader, 1, MPI_INT, 0, node_comm);
+        MPI_Comm_free(&node_comm);
+        std::vector<int> leaders(m_size);
+        MPI_Allgather(&leader, 1, MPI_INT, leaders.data(), 1, MPI_INT, m_comm);
+        for(int r = 0; r < m_size; r++) {
+            if(leaders[r] == r) m_shard_hosts.push_back(r);
+        }
+        m_home_shard = std::find(m_shard_hosts.begin(), m_shard_hosts.end(), leader)
+                     - m_shard_hosts.begin();
+        m_shard_exhausted.reset(new std::atomic<bool>[m_shard_hosts.size()]());
+        // node leaders expose a counter, initialized to 0
+        MPI_Aint win_size = (leader == m_rank) ? sizeof(uint64_t) : 0;
+        MPI_Win_allocate(win_size, sizeof(uint64_t), MPI_INFO_NULL, m_comm, &m_counter, &m_win);
+        MPI_Win_lock_all(MPI_MODE_NOCHECK, m_win);
+        if(win_size) {
+            uint64_t zero = 0;
+            MPI_Accumulate(&zero, 1, MPI_UINT64_T, m_rank, 0, 1, MPI_UINT64_T, MPI_REPLACE, m_win);
+            MPI_Win_flush(m_rank, m_win);
+        }
+        MPI_Barrier(m_comm);
+    }
+
+    uint64_t _shard_size(size_t shard) const {
+        size_t num_shards = m_shard_hosts.size();
+        if(shard >= m_work.size()) return 0;
+        return (m_work.size() - shard + num_shards - 1) / num_shards;
+    }
+};
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef __DATALOADER_EVENT_INDEX_H
+#define __DATALOADER_EVENT_INDEX_H
+
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <hepnos.hpp>
+
+/**
+ * Index of the events created for a file, shared by all its tables.
+ * It is a flat array sorted by event number. Tables, whose event
+ * columns are sorted as well, are matched against it with a linear
+ * merge instead of a hash lookup per event.
+ */
+class EventIndex {
+
+    public:
+
+    /**
+     * Fills result with the events corresponding to the provided list
+     * of event numbers, which must be sorted and distinct. Events that
+     * are not in the index yet are obtained by calling create(number)
+     * and added to the index.
+     */
+    template<typename CreateFn>
+    void lookup(const std::vector<hepnos::EventNumber>& numbers,
+                std::vector<hepnos::Event>& result,
+                CreateFn&& create) {
+        result.clear();
+        result.reserve(numbers.size());
+        std::vector<Entry> added;
+        size_t i = 0;
+        for(auto n : numbers) {
+            while(i < m_entries.size() && m_entries[i].number < n) i += 1;
+            if(i < m_entries.size() && m_entries[i].number == n) {
+                result.push_back(m_entries[i].event);
+            } else {
+                result.push_back(create(n));
+                added.push_back(Entry{n, result.back()});
+            }
+        }
+        if(added.empty()) return;
+        size_t middle = m_entries.size();
+        m_entries.insert(m_entries.end(), added.begin(), added.end());
+        std::inplace_merge(m_entries.begin(), m_entries.begin() + middle, m_entries.end(),
+            [](const Entry& a, const Entry& b) { return a.number < b.number; });
+    }
+
+    size_t size() const {
+        return m_entries.size();
+    }
+
+    /**
+     * Makes sure the rows of a table are sorted by event number so that
+     * all the rows of an event are contiguous, reordering both the event
+     * column and the table if needed (stable with respect to the original
+     * order of the rows of each event). Returns true if the table had to
+     * be reordered.
+     */
+    template<typename T>
+    static bool sort_rows(std::vector<unsigned>& events, std::vector<T>& table) {
+        if(std::is_sorted(events.begin(), events.end())) return false;
+        std::vector<size_t> order(events.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(),
+            [&events](size_t a, size_t b) { return events[a] < events[b]; });
+        std::vector<unsigned> sorted_events;
+        std::vector<T> sorted_table;
+        sorted_events.reserve(events.size());
+        sorted_table.reserve(table.size());
+        for(auto i : order) {
+            sorted_events.push_back(events[i]);
+            sorted_table.push_back(std::move(table[i]));
+        }
+        events = std::move(sorted_events);
+        table  = std::move(sorted_table);
+        return true;
+    }
+
+    private:
+
+    struct Entry {
+        hepnos::EventNumber number;
+        hepnos::Event       event;
+    };
+
+    std::vector<Entry> m_entries; // entries sorted by event number
+};
+
+#endif
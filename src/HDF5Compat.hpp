@@ -0,0 +1,42 @@
+#ifndef __DATALOADER_HDF5_COMPAT_H
+#define __DATALOADER_HDF5_COMPAT_H
+
+#include <hdf5.h>
+
+/**
+ * Wrappers around the HDF5 functions whose signature changed between
+ * 1.10 and 1.12, so that the dataloader builds with either.
+ */
+class HDF5Compat {
+
+    public:
+
+    /**
+     * Type of the object linked as name in loc (H5O_TYPE_UNKNOWN on error).
+     * Only the basic object information is queried.
+     */
+    static H5O_type_t object_type(hid_t loc, const char* name) {
+        H5O_info_t info;
+#if H5_VERSION_GE(1, 12, 0)
+        herr_t ret = H5Oget_info_by_name3(loc, name, &info, H5O_INFO_BASIC, H5P_DEFAULT);
+#elif H5_VERSION_GE(1, 10, 3)
+        herr_t ret = H5Oget_info_by_name2(loc, name, &info, H5O_INFO_BASIC, H5P_DEFAULT);
+#else
+        herr_t ret = H5Oget_info_by_name(loc, name, &info, H5P_DEFAULT);
+#endif
+        return ret < 0 ? H5O_TYPE_UNKNOWN : info.type;
+    }
+
+    /**
+     * Frees the variable-length data read into buf.
+     */
+    static herr_t reclaim(hid_t type, hid_t space, void* buf) {
+#if H5_VERSION_GE(1, 12, 0)
+        return H5Treclaim(type, space, H5P_DEFAULT, buf);
+#else
+        return H5Dvlen_reclaim(type, space, H5P_DEFAULT, buf);
+#endif
+    }
+};
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef __DATALOADER_JOURNAL_H
+#define __DATALOADER_JOURNAL_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <fstream>
+#include <sstream>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <thallium.hpp>
+#include "WorkUnit.hpp"
+
+namespace tl = thallium;
+
+/**
+ * The Journal records the work units whose data has been stored in
+ * HEPnOS, so that an interrupted load can be resumed (--resume) without
+ * loading them again. Each process appends to its own file
+ * (<path>.<rank>), one serialized WorkUnit per line, and syncs it to
+ * disk after each record. Units must only be recorded once the flush
+ * of the WriteBatch containing their data has completed.
+ */
+class Journal {
+
+    public:
+
+    Journal(const std::string& path, int rank)
+    : m_path(path), m_rank(rank) {}
+
+    ~Journal() {
+        if(m_fd >= 0) close(m_fd);
+    }
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    /**
+     * Loads the units recorded by all the processes of previous runs.
+     * Processes only create their file once they record a unit, so every
+     * <path>.<rank> file of the directory is read, whatever the ranks.
+     * Returns the number of units loaded.
+     */
+    size_t load() {
+        size_t count = 0;
+        for(auto& file : _rank_files()) {
+            std::ifstream infile(file);
+            if(!infile.good()) continue;
+            std::stringstream ss;
+            ss << infile.rdbuf();
+            std::string content = ss.str();
+            // a line without a trailing newline was interrupted while written
+            content.resize(content.find_last_of('\n') + 1);
+            std::stringstream lines(content);
+            std::string line;
+            while(std::getline(lines, line)) {
+                if(line.empty() || line[0] == '#') continue;
+                if(m_done.insert(line).second) count += 1;
+            }
+        }
+        return count;
+    }
+
+    /**
+     * Checks whether a unit was completed by a previous run. A file is
+     * done if it was recorded as a whole, or if the entire tables of all
+     * the requested products were recorded.
+     */
+    bool is_done(const WorkUnit& unit, const std::vector<std::string>& product_names) const {
+        if(m_done.count(unit.filename)) return true;
+        if(!unit.is_whole_file()) return m_done.count(unit.to_string()) > 0;
+        for(auto& p : product_names) {
+            WorkUnit table_unit;
+            table_unit.filename = unit.filename;
+            table_unit.product  = p;
+            if(m_done.count(table_unit.to_string()) == 0) return false;
+        }
+        return !product_names.empty();
+    }
+
+    /**
+     * Appends the provided units to this process' journal file.
+     * Returns false if they could not be written to disk.
+     */
+    bool record(const std::vector<WorkUnit>& units) {
+        if(units.empty()) return true;
+        std::string lines;
+        for(auto& unit : units) {
+            lines += unit.to_string();
+            lines += '\n';
+        }
+        std::unique_lock<tl::mutex> lock(m_mtx);
+        if(m_fd < 0) {
+            m_fd = open(_rank_path(m_rank).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+            if(m_fd < 0) return false;
+        }
+        const char* data = lines.data();
+        size_t remaining = lines.size();
+        while(remaining > 0) {
+            ssize_t written = write(m_fd, data, remaining);
+            if(written < 0) return false;
+            data += written;
+            remaining -= written;
+        }
+        return fsync(m_fd) == 0;
+    }
+
+    private:
+
+    std::string _rank_path(int rank) const {
+        return m_path + "." + std::to_string(rank);
+    }
+
+    std::vector<std::string> _rank_files() const {
+        std::vector<std::string> files;
+        size_t slash = m_path.find_last_of('/');
+        std::string dir    = slash == std::string::npos ? "." : m_path.substr(0, slash + 1);
+        std::string prefix = (slash == std::string::npos ? m_path : m_path.substr(slash + 1)) + ".";
+        DIR* d = opendir(dir.c_str());
+        if(!d) return files;
+        while(struct dirent* entry = readdir(d)) {
+            std::string name = entry->d_name;
+            if(name.size() <= prefix.size() || name.compare(0, prefix.size(), prefix) != 0)
+                continue;
+            if(name.find_first_not_of("0123456789", prefix.size()) != std::string::npos)
+                continue;
+            files.push_back(slash == std::string::npos ? name : dir + name);
+        }
+        closedir(d);
+        return files;
+    }
+
+    std::string           m_path; // prefix of the journal files
+    int                   m_rank; // rank of this process
+    int                   m_fd = -1; // journal file of this process
+    std::set<std::string> m_done; // units recorded by previous runs
+    tl::mutex             m_mtx; // protects m_fd
+};
+
+#endif
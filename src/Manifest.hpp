@@ -0,0 +1,234 @@
+#ifndef __DATALOADER_MANIFEST_H
+#define __DATALOADER_MANIFEST_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <hdf5.h>
+
+/**
+ * The Manifest holds, for each input file, its size, its modification
+ * time, and the number of rows of each product table it contains.
+ * It is built by a prescan phase and cached to disk so that loading
+ * the same list of files again does not require opening them.
+ */
+class Manifest {
+
+    public:
+
+    struct FileInfo {
+        std::string                     filename; // path of the HDF5 file
+        uint64_t                        size = 0; // size of the file in bytes
+        int64_t                         mtime = 0; // last modification time
+        std::map<std::string, uint64_t> rows; // number of rows per product
+
+        /**
+         * Returns the amount of work this file represents for the
+         * given list of products (total number of rows). Falls back
+         * to the file size if none of the products were found.
+         */
+        uint64_t cost(const std::vector<std::string>& product_names) const {
+            uint64_t total = 0;
+            for(auto& p : product_names) {
+                auto it = rows.find(p);
+                if(it != rows.end()) total += it->second;
+            }
+            return total > 0 ? total : size;
+        }
+
+        bool has_products(const std::vector<std::string>& product_names) const {
+            for(auto& p : product_names)
+                if(rows.count(p) == 0) return false;
+            return true;
+        }
+
+        std::string to_string() const {
+            std::stringstream ss;
+            ss << filename << '\t' << size << '\t' << mtime << '\t';
+            bool first = true;
+            for(auto& r : rows) {
+                if(!first) ss << ',';
+                ss << r.first << '=' << r.second;
+                first = false;
+            }
+            return ss.str();
+        }
+
+        static bool from_string(const std::string& line, FileInfo& info) {
+            std::stringstream ss(line);
+            std::string size, mtime, rows;
+            if(!std::getline(ss, info.filename, '\t')) return false;
+            if(!std::getline(ss, size, '\t')) return false;
+            if(!std::getline(ss, mtime, '\t')) return false;
+            std::getline(ss, rows);
+            info.rows.clear();
+            try {
+                info.size  = std::stoull(size);
+                info.mtime = std::stoll(mtime);
+                std::stringstream rs(rows);
+                std::string entry;
+                while(std::getline(rs, entry, ',')) {
+                    auto eq = entry.find('=');
+                    if(eq == std::string::npos) continue;
+                    info.rows[entry.substr(0, eq)] = std::stoull(entry.substr(eq+1));
+                }
+            } catch(const std::logic_error&) { // invalid_argument or out_of_range
+                return false;
+            }
+            return true;
+        }
+    };
+
+    /**
+     * Converts a product name (e.g. hep::rec_vtx_elastic_fuzzyk_png)
+     * into the name of the HDF5 group holding its table
+     * (e.g. rec.vtx.elastic.fuzzyk.png).
+     */
+    static std::string hdf5_group_name(const std::string& product_name) {
+        std::string name = product_name;
+        auto pos = name.rfind("::");
+        if(pos != std::string::npos) name = name.substr(pos+2);
+        for(auto& c : name) if(c == '_') c = '.';
+        return name;
+    }
+
+    /**
+     * Returns the number of rows of the table corresponding to the
+     * given product in an open HDF5 file, or 0 if the table does not exist.
+     */
+    static uint64_t count_rows(hid_t hdf_file, const std::string& product_name) {
+        std::string group = hdf5_group_name(product_name);
+        if(H5Lexists(hdf_file, group.c_str(), H5P_DEFAULT) <= 0) return 0;
+        std::string path = group + "/evt";
+        if(H5Lexists(hdf_file, path.c_str(), H5P_DEFAULT) <= 0) return 0;
+        hid_t dset = H5Dopen(hdf_file, path.c_str(), H5P_DEFAULT);
+        if(dset < 0) return 0;
+        hid_t space = H5Dget_space(dset);
+        hsize_t dims[H5S_MAX_RANK];
+        int ndims = H5Sget_simple_extent_dims(space, dims, nullptr);
+        H5Sclose(space);
+        H5Dclose(dset);
+        return ndims > 0 ? dims[0] : 0;
+    }
+
+    /**
+     * Fills the size and mtime of a FileInfo using stat().
+     * Returns false if the file could not be stat-ed.
+     */
+    static bool stat_file(FileInfo& info) {
+        struct stat st;
+        if(stat(info.filename.c_str(), &st) != 0) return false;
+        info.size  = st.st_size;
+        info.mtime = st.st_mtime;
+        return true;
+    }
+
+    /**
+     * Opens the file and counts the rows of each of the provided products.
+     */
+    static FileInfo scan(const std::string& filename,
+                         const std::vector<std::string>& product_names) {
+        FileInfo info;
+        info.filename = filename;
+        stat_file(info);
+        hid_t hdf_file = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+        if(hdf_file < 0) return info;
+        for(auto& p : product_names) {
+            info.rows[p] = count_rows(hdf_file, p);
+        }
+        H5Fclose(hdf_file);
+        return info;
+    }
+
+    /**
+     * Returns a pointer to the entry for the file, or nullptr.
+     */
+    const FileInfo* find(const std::string& filename) const {
+        auto it = m_entries.find(filename);
+        if(it == m_entries.end()) return nullptr;
+        return &(it->second);
+    }
+
+    /**
+     * Returns a pointer to the cached entry for the file if it exists
+     * and is still up to date (same size and mtime), nullptr otherwise.
+     */
+    const FileInfo* find_valid(const std::string& filename) const {
+        auto it = m_entries.find(filename);
+        if(it == m_entries.end()) return nullptr;
+        FileInfo current;
+        current.filename = filename;
+        if(!stat_file(current)) return nullptr;
+        if(current.size != it->second.size || current.mtime != it->second.mtime)
+            return nullptr;
+        return &(it->second);
+    }
+
+    void update(const FileInfo& info) {
+        auto& entry = m_entries[info.filename];
+        if(entry.size != info.size || entry.mtime != info.mtime)
+            entry.rows.clear();
+        entry.filename = info.filename;
+        entry.size     = info.size;
+        entry.mtime    = info.mtime;
+        for(auto& r : info.rows) entry.rows[r.first] = r.second;
+    }
+
+    size_t size() const {
+        return m_entries.size();
+    }
+
+    /**
+     * Loads the entries of a manifest file. Malformed lines are skipped
+     * (their files are scanned again) and listed by invalid_lines().
+     */
+    bool load(const std::string& path) {
+        std::ifstream infile(path);
+        if(!infile.good()) return false;
+        std::string line;
+        size_t line_number = 0;
+        while(std::getline(infile, line)) {
+            line_number += 1;
+            if(line.empty() || line[0] == '#') continue;
+            FileInfo info;
+            if(FileInfo::from_string(line, info))
+                m_entries[info.filename] = std::move(info);
+            else
+                m_invalid_lines.push_back(path + ":" + std::to_string(line_number) + ": " + line);
+        }
+        return true;
+    }
+
+    /**
+     * Lines skipped by load() because they could not be
+     * parsed, as <path>:<line number>: <line>.
+     */
+    const std::vector<std::string>& invalid_lines() const {
+        return m_invalid_lines;
+    }
+
+    bool save(const std::string& path) const {
+        std::string tmp_path = path + ".tmp";
+        {
+            std::ofstream outfile(tmp_path);
+            if(!outfile.good()) return false;
+            outfile << "# hepnos-dataloader manifest v1\n";
+            for(auto& e : m_entries)
+                outfile << e.second.to_string() << '\n';
+            if(!outfile.good()) return false;
+        }
+        return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+    }
+
+    private:
+
+    std::map<std::string, FileInfo> m_entries;
+    std::vector<std::string>        m_invalid_lines; // lines load() could not parse
+};
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef __DATALOADER_MEMORY_BUDGET_H
+#define __DATALOADER_MEMORY_BUDGET_H
+
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <thallium.hpp>
+
+namespace tl = thallium;
+
+/**
+ * Bytes held by a process across the ingest pipeline: decoded tables and
+ * data stored in WriteBatches but not flushed yet. With a budget, the
+ * workers call wait() between tables, which pauses their reading while
+ * the budget is exceeded, until tables are freed and WriteBatches are
+ * drained. A worker must release what it holds (flush its WriteBatches)
+ * before waiting, otherwise workers could wait for each other forever.
+ * A budget of 0 only keeps track of the peak usage.
+ */
+class MemoryBudget {
+
+    public:
+
+    struct Statistics {
+        size_t   peak = 0; // highest number of bytes in use
+        uint64_t stalls = 0; // calls to wait() that had to wait
+        double   stall_time = 0.0; // seconds spent waiting
+    };
+
+    void set_budget(size_t budget) {
+        std::unique_lock<tl::mutex> lock(m_mtx);
+        m_budget = budget;
+    }
+
+    size_t budget() const {
+        return m_budget;
+    }
+
+    void acquire(size_t bytes) {
+        if(bytes == 0) return;
+        std::unique_lock<tl::mutex> lock(m_mtx);
+        m_used += bytes;
+        if(m_used > m_stats.peak) m_stats.peak = m_used;
+    }
+
+    void release(size_t bytes) {
+        if(bytes == 0) return;
+        {
+            std::unique_lock<tl::mutex> lock(m_mtx);
+            m_used -= std::min(bytes, m_used);
+        }
+        m_cv.notify_all();
+    }
+
+    bool exceeded() const {
+        std::unique_lock<tl::mutex> lock(m_mtx);
+        return _exceeded();
+    }
+
+    /**
+     * Blocks while the budget is exceeded.
+     */
+    void wait() {
+        std::unique_lock<tl::mutex> lock(m_mtx);
+        if(!_exceeded()) return;
+        auto t0 = std::chrono::steady_clock::now();
+        while(_exceeded()) m_cv.wait(lock);
+        m_stats.stalls += 1;
+        m_stats.stall_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    }
+
+    Statistics statistics() const {
+        std::unique_lock<tl::mutex> lock(m_mtx);
+        return m_stats;
+    }
+
+    private:
+
+    bool _exceeded() const {
+        return m_budget > 0 && m_used >= m_budget;
+    }
+
+    size_t                 m_budget = 0; // maximum number of bytes (0 for no limit)
+    size_t                 m_used = 0; // bytes currently in use
+    Statistics             m_stats; // peak usage and stalls
+    mutable tl::mutex      m_mtx; // protects the above
+    tl::condition_variable m_cv; // notified when bytes are released
+};
+
+#endif
@@ -0,0 +1,601 @@
+#ifndef __DATALOADER_OUTPUT_SINK_H
+#define __DATALOADER_OUTPUT_SINK_H
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <chrono>
+#include <functional>
+#include <type_traits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <boost/archive/binary_oarchive.hpp>
+#include <hepnos.hpp>
+#include "EventIndex.hpp"
+#include "BatchTuner.hpp"
+#include "Compression.hpp"
+#include "BulkProduct.hpp"
+#include "RawProduct.hpp"
+#include "SubRunCache.hpp"
+
+/**
+ * An OutputSink receives the events and products decoded from HDF5
+ * files. Each worker has its own sink. The HEPnOSSink stores them in
+ * HEPnOS. The other sinks serialize products with Boost the way HEPnOS
+ * does, and either discard them (DiscardSink) or append them to a local
+ * file (FileSink), which allows measuring serialization and batching
+ * costs without a running HEPnOS service.
+ */
+class OutputSink {
+
+    public:
+
+    /**
+     * Bytes before and after compression of a type of product,
+     * and the time spent compressing them.
+     */
+    struct CompressionStatistics {
+        uint64_t bytes_in  = 0;
+        uint64_t bytes_out = 0;
+        double   seconds   = 0.0;
+    };
+
+    virtual ~OutputSink() = default;
+
+    /**
+     * Stores the products of the given type as CompressedProducts
+     * compressed with the codec instead of vectors of rows.
+     */
+    void set_compression(int product, Compressor::Codec codec, int level = 0) {
+        if(product < 0) return;
+        if((size_t)product >= m_compression.size()) m_compression.resize(product+1);
+        m_compression[product].enabled = codec != Compressor::NONE;
+        m_compression[product].codec   = codec;
+        m_compression[product].level   = level;
+    }
+
+    /**
+     * Stores the products of trivially copyable types as RawProducts
+     * instead of vectors of rows. Compressed products are not affected.
+     */
+    void set_raw_layout(bool enabled) {
+        m_raw_layout = enabled;
+    }
+
+    /**
+     * Compression statistics of a type of product.
+     */
+    CompressionStatistics compression_statistics(int product) const {
+        if(product < 0 || (size_t)product >= m_compression.size()) return CompressionStatistics();
+        return m_compression[product].stats;
+    }
+
+    /**
+     * Starts storing the events of a new subrun.
+     */
+    void begin_subrun(hepnos::RunNumber run, hepnos::SubRunNumber subrun) {
+        m_run = run;
+        m_subrun = subrun;
+        m_event_index = EventIndex();
+        _begin_subrun();
+    }
+
+    /**
+     * Makes sure the events with the provided (sorted, distinct) numbers
+     * exist in the current subrun, creating those that were not created
+     * yet. Subsequent calls to store() refer to these events by their
+     * index in this list. Returns the number of events created.
+     */
+    size_t create_events(const std::vector<hepnos::EventNumber>& numbers) {
+        auto t0 = std::chrono::steady_clock::now();
+        size_t created = 0;
+        m_numbers = numbers;
+        m_event_index.lookup(numbers, m_events,
+            [&](hepnos::EventNumber n) {
+                created += 1;
+                return _create_event(n);
+            });
+        _stored(-1, created, _seconds_since(t0));
+        return created;
+    }
+
+    /**
+     * Stores the rows of a table as products of the events passed to
+     * the last call to create_events(): the product of event i is made
+     * of rows [offsets[i], offsets[i+1]). The product index identifies
+     * the type of product (-1 is reserved for events).
+     */
+    template<typename T>
+    void store(int product, const std::string& label, const std::vector<T>& table,
+               const std::vector<size_t>& offsets) {
+        auto t0 = std::chrono::steady_clock::now();
+        size_t num_products = offsets.size() - 1;
+        m_num_products += num_products;
+        hepnos::WriteBatch* wb = _write_batch(product);
+        if(product >= 0 && (size_t)product < m_compression.size() && m_compression[product].enabled) {
+            auto& c = m_compression[product];
+            std::string key_suffix = label + "#" + hepnos::demangle<CompressedProduct<T>>();
+            for(size_t i = 0; i < num_products; i++) {
+                std::string payload = _serialize_rows(table, offsets[i], offsets[i+1]);
+                CompressedProduct<T> compressed;
+                auto t1 = std::chrono::steady_clock::now();
+                compressed.compress(c.codec, c.level, payload);
+                c.stats.seconds   += _seconds_since(t1);
+                c.stats.bytes_in  += payload.size();
+                c.stats.bytes_out += compressed.data.size();
+                if(wb) {
+                    m_events[i].store(*wb, label, compressed);
+                } else {
+                    std::stringstream ss;
+                    {
+                        boost::archive::binary_oarchive oa(ss, boost::archive::no_header);
+                        oa << compressed;
+                    }
+                    std::string key = _event_key(m_numbers[i]) + key_suffix;
+                    std::string value = ss.str();
+                    m_num_bytes += key.size() + value.size();
+                    _store_serialized(key, value);
+                }
+            }
+        } else if(m_raw_layout && _store_raw(label, table, offsets, wb, std::is_trivially_copyable<T>())) {
+            // stored as RawProducts
+        } else if(wb) {
+            // HEPnOS serializes products itself
+            for(size_t i = 0; i < num_products; i++)
+                m_events[i].store(*wb, label, table, offsets[i], offsets[i+1]);
+        } else {
+            std::string key_suffix = label + "#" + hepnos::demangle<std::vector<T>>();
+            for(size_t i = 0; i < num_products; i++) {
+                std::string key = _event_key(m_numbers[i]) + key_suffix;
+                std::string value = _serialize_rows(table, offsets[i], offsets[i+1]);
+                m_num_bytes += key.size() + value.size();
+                _store_serialized(key, value);
+            }
+        }
+        _stored(product, num_products, _seconds_since(t0));
+    }
+
+    /**
+     * Stores rows [offsets.front(), offsets.back()) of a table as a single
+     * BulkProduct of the current subrun, indexed by the events passed to
+     * the last call to create_events() and their offsets.
+     */
+    template<typename T>
+    void store_bulk(int product, const std::string& label, const std::vector<T>& table,
+                    const std::vector<size_t>& offsets) {
+        auto t0 = std::chrono::steady_clock::now();
+        BulkProduct<T> bulk;
+        bulk.events.assign(m_numbers.begin(), m_numbers.end());
+        bulk.offsets.reserve(offsets.size());
+        for(auto offset : offsets) bulk.offsets.push_back(offset - offsets.front());
+        bulk.rows.assign(table.begin() + offsets.front(), table.begin() + offsets.back());
+        m_num_products += 1;
+        hepnos::WriteBatch* wb = _write_batch(product);
+        hepnos::SubRun* subrun = _subrun();
+        if(wb && subrun) {
+            subrun->store(*wb, label, bulk);
+        } else {
+            std::stringstream ss;
+            {
+                boost::archive::binary_oarchive oa(ss, boost::archive::no_header);
+                oa << bulk;
+            }
+            std::string key = _subrun_key() + label + "#" + hepnos::demangle<BulkProduct<T>>();
+            std::string value = ss.str();
+            m_num_bytes += key.size() + value.size();
+            _store_serialized(key, value);
+        }
+        _stored(product, 1, _seconds_since(t0));
+    }
+
+    /**
+     * Makes sure the data stored so far has reached its destination.
+     * Returns false if this cannot be guaranteed before finish().
+     */
+    virtual bool flush() = 0;
+
+    /**
+     * Flushes all the remaining data.
+     */
+    virtual void finish() = 0;
+
+    /**
+     * Flushes the data stored so far, even when flush() could not
+     * guarantee that it is stored (with an AsyncEngine), to release
+     * the memory it holds.
+     */
+    virtual void drain() = 0;
+
+    uint64_t num_products() const { return m_num_products; }
+    uint64_t num_bytes() const { return m_num_bytes; }
+
+    protected:
+
+    virtual void _begin_subrun() = 0;
+    virtual hepnos::Event _create_event(hepnos::EventNumber n) = 0;
+    virtual void _store_serialized(const std::string& key, const std::string& value) = 0;
+
+    /**
+     * Returns the WriteBatch in which to store products of the given
+     * type if the sink stores objects in HEPnOS, null if it stores
+     * serialized products with _store_serialized.
+     */
+    virtual hepnos::WriteBatch* _write_batch(int /*product*/) { return nullptr; }
+
+    /**
+     * Returns the current subrun if the sink stores objects in HEPnOS.
+     */
+    virtual hepnos::SubRun* _subrun() { return nullptr; }
+
+    /**
+     * Called after storing or creating items of the given product
+     * (-1 for events), with the time it took.
+     */
+    virtual void _stored(int /*product*/, size_t /*num_items*/, double /*seconds*/) {}
+
+    static double _seconds_since(std::chrono::steady_clock::time_point t0) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    }
+
+    /**
+     * Serializes rows [begin, end) of a table the way the serializing
+     * sinks store products: the number of rows followed by the rows.
+     */
+    template<typename T>
+    static std::string _serialize_rows(const std::vector<T>& table, size_t begin, size_t end) {
+        std::stringstream ss;
+        {
+            boost::archive::binary_oarchive oa(ss, boost::archive::no_header);
+            size_t count = end - begin;
+            oa << count;
+            for(size_t i = begin; i < end; i++) oa << table[i];
+        }
+        return ss.str();
+    }
+
+    template<typename T>
+    bool _store_raw(const std::string&, const std::vector<T>&, const std::vector<size_t>&,
+                    hepnos::WriteBatch*, std::false_type) {
+        return false;
+    }
+
+    template<typename T>
+    bool _store_raw(const std::string& label, const std::vector<T>& table,
+                    const std::vector<size_t>& offsets, hepnos::WriteBatch* wb, std::true_type) {
+        size_t num_products = offsets.size() - 1;
+        if(wb) {
+            for(size_t i = 0; i < num_products; i++) {
+                RawProduct<T> raw(table.data() + offsets[i], offsets[i+1] - offsets[i]);
+                m_events[i].store(*wb, label, raw);
+            }
+        } else {
+            std::string key_suffix = label + "#" + hepnos::demangle<RawProduct<T>>();
+            for(size_t i = 0; i < num_products; i++) {
+                std::string key = _event_key(m_numbers[i]) + key_suffix;
+                std::string value = RawProduct<T>::to_bytes(table.data() + offsets[i], offsets[i+1] - offsets[i]);
+                m_num_bytes += key.size() + value.size();
+                _store_serialized(key, value);
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Key of an event in the serializing sinks: run, subrun and event
+     * numbers in big-endian order, like HEPnOS' event keys.
+     */
+    std::string _event_key(hepnos::EventNumber n) const {
+        uint64_t numbers[3] = { m_run, m_subrun, n };
+        return _numbers_key(numbers, 3);
+    }
+
+    /**
+     * Key of the current subrun, under which bulk products are stored.
+     */
+    std::string _subrun_key() const {
+        uint64_t numbers[2] = { m_run, m_subrun };
+        return _numbers_key(numbers, 2);
+    }
+
+    static std::string _numbers_key(const uint64_t* numbers, int count) {
+        std::string key(count*sizeof(uint64_t), '\0');
+        for(int i = 0; i < count; i++)
+            for(int b = 0; b < 8; b++)
+                key[i*8 + b] = (char)(numbers[i] >> (56 - 8*b));
+        return key;
+    }
+
+    hepnos::RunNumber       m_run = 0; // current run
+    hepnos::SubRunNumber    m_subrun = 0; // current subrun
+    uint64_t                m_num_products = 0; // number of products stored
+    uint64_t                m_num_bytes = 0; // bytes of keys and values serialized
+
+    private:
+
+    struct Compression {
+        bool                  enabled = false;
+        Compressor::Codec     codec = Compressor::NONE;
+        int                   level = 0;
+        CompressionStatistics stats;
+    };
+
+    EventIndex                       m_event_index; // events of the current subrun
+    std::vector<hepnos::EventNumber> m_numbers; // numbers passed to the last create_events()
+    std::vector<hepnos::Event>       m_events; // corresponding events
+    std::vector<Compression>         m_compression; // compression of each type of product
+    bool                             m_raw_layout = false; // store trivially copyable products as RawProducts
+};
+
+/**
+ * Sink storing events and products in a HEPnOS DataSet through
+ * WriteBatches (which may be bound to an AsyncEngine). Either a single
+ * WriteBatch is used for everything, or one per product type plus one
+ * for events, in which case each can have its own size and, if a target
+ * latency is provided, be resized by a BatchTuner after each flush.
+ */
+class HEPnOSSink : public OutputSink {
+
+    public:
+
+    typedef std::function<hepnos::WriteBatch(size_t)> BatchFactory;
+
+    /**
+     * RPCs sent by the WriteBatches of the sink. A WriteBatch keeps the
+     * pending key/value pairs of each destination database together and
+     * sends them with one RPC per database when flushed, so the number of
+     * RPCs per flush is the number of databases its operations touched.
+     * With an AsyncEngine, batches are sent in the background at times the
+     * sink does not see, so no flushes are counted and only the RPCs are.
+     */
+    struct RPCStatistics {
+        uint64_t flushes = 0; // synchronous calls to flush() and finish()
+        uint64_t rpcs    = 0; // RPCs sent
+        uint64_t bytes   = 0; // bytes of keys and values sent
+    };
+
+    /**
+     * sizes contains the initial size of the single WriteBatch, or the
+     * sizes of the WriteBatch of events followed by those of each product.
+     * Tuning only happens when flushes are synchronous. If a SubRunCache
+     * is provided, subrun handles are obtained from it instead of creating
+     * runs and subruns synchronously.
+     */
+    HEPnOSSink(const hepnos::DataSet& dataset, const std::vector<size_t>& sizes,
+               BatchFactory make_batch, bool async, double target_latency = 0.0,
+               SubRunCache* subruns = nullptr)
+    : m_dataset(dataset)
+    , m_make_batch(std::move(make_batch))
+    , m_async(async)
+    , m_subruns(subruns) {
+        for(auto size : sizes) {
+            m_batches.emplace_back();
+            auto& b = m_batches.back();
+            b.size  = size;
+            b.batch = m_make_batch(size);
+            b.tuner = BatchTuner(async ? 0.0 : target_latency);
+        }
+    }
+
+    bool flush() override {
+        // With an AsyncEngine, data is only guaranteed to be
+        // stored by the final flush of the WriteBatch
+        if(m_async) return false;
+        m_rpc_stats.flushes += 1;
+        for(auto& b : m_batches) {
+            auto t0 = std::chrono::steady_clock::now();
+            b.batch.flush();
+            b.time += _seconds_since(t0);
+            size_t new_size = b.tuner.update(b.size, b.items, b.time);
+            b.items = 0;
+            b.time  = 0.0;
+            // WriteBatches cannot be resized, an empty one is created instead
+            if(new_size > b.size*1.1 || new_size < b.size*0.9) {
+                _add_rpc_statistics(b.batch, m_rpc_stats);
+                b.size  = new_size;
+                b.batch = m_make_batch(new_size);
+            }
+        }
+        return true;
+    }
+
+    void finish() override {
+        if(not m_async) m_rpc_stats.flushes += 1;
+        for(auto& b : m_batches) b.batch.flush();
+    }
+
+    void drain() override {
+        finish();
+    }
+
+    /**
+     * RPCs sent so far by all the WriteBatches, including those that
+     * were replaced when resized. Requires WriteBatch statistics.
+     */
+    RPCStatistics rpc_statistics() const {
+        RPCStatistics stats = m_rpc_stats;
+        for(auto& b : m_batches) _add_rpc_statistics(b.batch, stats);
+        return stats;
+    }
+
+    /**
+     * Current size of each WriteBatch, in the same order as
+     * the sizes passed to the constructor.
+     */
+    std::vector<size_t> batch_sizes() const {
+        std::vector<size_t> sizes;
+        for(auto& b : m_batches) sizes.push_back(b.size);
+        return sizes;
+    }
+
+    /**
+     * Statistics of each WriteBatch, in the same order as the sizes passed
+     * to the constructor. Resized WriteBatches only report their
+     * statistics since the last resize.
+     */
+    std::vector<hepnos::WriteBatchStatistics> statistics() const {
+        std::vector<hepnos::WriteBatchStatistics> stats(m_batches.size());
+        for(size_t i = 0; i < m_batches.size(); i++)
+            m_batches[i].batch.collectStatistics(stats[i]);
+        return stats;
+    }
+
+    protected:
+
+    void _begin_subrun() override {
+        if(m_subruns)
+            m_subrun_handle = m_subruns->get(m_run, m_subrun, *_write_batch(-1));
+        else
+            m_subrun_handle = m_dataset.createRun(m_run).createSubRun(m_subrun);
+    }
+
+    hepnos::Event _create_event(hepnos::EventNumber n) override {
+        // createEvent only puts the event's key, so creating
+        // an event that already exists is harmless
+        return m_subrun_handle.createEvent(*_write_batch(-1), n);
+    }
+
+    void _store_serialized(const std::string&, const std::string&) override {}
+
+    hepnos::WriteBatch* _write_batch(int product) override {
+        return &m_batches[_batch_index(product)].batch;
+    }
+
+    hepnos::SubRun* _subrun() override {
+        return &m_subrun_handle;
+    }
+
+    void _stored(int product, size_t num_items, double seconds) override {
+        auto& b = m_batches[_batch_index(product)];
+        b.items += num_items;
+        b.time  += seconds;
+    }
+
+    private:
+
+    struct Batch {
+        hepnos::WriteBatch batch; // current WriteBatch
+        size_t             size = 0; // its maximum size
+        size_t             items = 0; // items stored since the last flush
+        double             time = 0.0; // time spent storing and flushing them
+        BatchTuner         tuner; // chooses the size after each flush
+    };
+
+    size_t _batch_index(int product) const {
+        return m_batches.size() == 1 ? 0 : product + 1;
+    }
+
+    static void _add_rpc_statistics(const hepnos::WriteBatch& batch, RPCStatistics& stats) {
+        hepnos::WriteBatchStatistics wb_stats;
+        batch.collectStatistics(wb_stats);
+        // batch_sizes is updated once per RPC, with the number of key/value pairs sent
+        stats.rpcs  += wb_stats.batch_sizes.num;
+        stats.bytes += wb_stats.key_sizes.avg * wb_stats.key_sizes.num
+                     + wb_stats.value_sizes.avg * wb_stats.value_sizes.num;
+    }
+
+    hepnos::DataSet    m_dataset; // dataset in which to store runs
+    hepnos::SubRun     m_subrun_handle; // current subrun
+    BatchFactory       m_make_batch; // creates WriteBatches of a given size
+    bool               m_async; // whether WriteBatches use an AsyncEngine
+    SubRunCache*       m_subruns; // handles of the subruns (may be null)
+    std::vector<Batch> m_batches; // single WriteBatch, or events and products
+    RPCStatistics      m_rpc_stats; // flushes, and RPCs of replaced WriteBatches
+};
+
+/**
+ * Sink serializing products and discarding them.
+ */
+class DiscardSink : public OutputSink {
+
+    public:
+
+    bool flush() override { return true; }
+
+    void finish() override {}
+
+    void drain() override {}
+
+    protected:
+
+    void _begin_subrun() override {}
+
+    hepnos::Event _create_event(hepnos::EventNumber n) override {
+        m_num_bytes += _event_key(n).size();
+        return hepnos::Event();
+    }
+
+    void _store_serialized(const std::string&, const std::string&) override {}
+};
+
+/**
+ * Sink appending serialized events (keys with an empty value) and
+ * products to a local file, as records made of the key size, the key,
+ * the value size and the value. Records are buffered until flush().
+ */
+class FileSink : public OutputSink {
+
+    public:
+
+    FileSink(const std::string& filename)
+    : m_filename(filename) {}
+
+    ~FileSink() {
+        flush();
+        if(m_fd >= 0) close(m_fd);
+    }
+
+    FileSink(const FileSink&) = delete;
+    FileSink& operator=(const FileSink&) = delete;
+
+    bool flush() override {
+        if(m_fd < 0) {
+            m_fd = open(m_filename.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+            if(m_fd < 0) return false;
+        }
+        const char* data = m_buffer.data();
+        size_t remaining = m_buffer.size();
+        while(remaining > 0) {
+            ssize_t written = write(m_fd, data, remaining);
+            if(written < 0) return false;
+            data += written;
+            remaining -= written;
+        }
+        m_buffer.clear();
+        return fdatasync(m_fd) == 0;
+    }
+
+    void finish() override {
+        flush();
+    }
+
+    void drain() override {
+        flush();
+    }
+
+    protected:
+
+    void _begin_subrun() override {}
+
+    hepnos::Event _create_event(hepnos::EventNumber n) override {
+        std::string key = _event_key(n);
+        m_num_bytes += key.size();
+        _store_serialized(key, std::string());
+        return hepnos::Event();
+    }
+
+    void _store_serialized(const std::string& key, const std::string& value) override {
+        uint64_t key_size = key.size(), value_size = value.size();
+        m_buffer.append(reinterpret_cast<const char*>(&key_size), sizeof(key_size));
+        m_buffer.append(key);
+        m_buffer.append(reinterpret_cast<const char*>(&value_size), sizeof(value_size));
+        m_buffer.append(value);
+    }
+
+    private:
+
+    std::string m_filename; // file to which records are appended
+    int         m_fd = -1; // file descriptor, opened by the first flush
+    std::string m_buffer; // records not written yet
+};
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef __DATALOADER_PREFETCHING_WORK_QUEUE_H
+#define __DATALOADER_PREFETCHING_WORK_QUEUE_H
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thallium.hpp>
+#include "AbstractWorkQueue.hpp"
+
+namespace tl = thallium;
+
+/**
+ * Wraps another work queue and keeps up to "lookahead" work items
+ * reserved for the current process, in addition to the one being
+ * processed. Reserved items are fetched in bulk. clear() discards the
+ * items reserved but not pulled yet, as the underlying queue discards
+ * its own: they are unfinished work, which the journal lets a later run
+ * resume.
+ */
+class PrefetchingWorkQueue : public AbstractWorkQueue {
+
+    public:
+
+    PrefetchingWorkQueue(std::unique_ptr<AbstractWorkQueue> queue, size_t lookahead)
+    : m_queue(std::move(queue))
+    , m_lookahead(lookahead) {}
+
+    void start_listening() override {
+        m_queue->start_listening();
+    }
+
+    void readonly() override {
+        m_queue->readonly();
+    }
+
+    void push(const std::string& work, uint64_t cost = 0) override {
+        m_queue->push(work, cost);
+    }
+
+    std::string pull() override {
+        std::unique_lock<tl::mutex> lock(m_mtx);
+        if(m_reserved.size() <= 1 && !m_exhausted) {
+            try {
+                auto work = m_queue->pull_bulk(m_lookahead + 1 - m_reserved.size());
+                m_reserved.insert(m_reserved.end(), work.begin(), work.end());
+                m_new_reservations.insert(m_new_reservations.end(), work.begin(), work.end());
+            } catch(EmptyQueueException&) {
+                m_exhausted = true;
+            }
+        }
+        if(m_reserved.empty()) throw EmptyQueueException();
+        std::string result = std::move(m_reserved.front());
+        m_reserved.pop_front();
+        return result;
+    }
+
+    /**
+     * Returns the items reserved since the last call to this function,
+     * so that the caller can start preparing for them.
+     */
+    std::vector<std::string> take_new_reservations() {
+        std::unique_lock<tl::mutex> lock(m_mtx);
+        std::vector<std::string> result(m_new_reservations.begin(), m_new_reservations.end());
+        m_new_reservations.clear();
+        return result;
+    }
+
+    /**
+     * Discards the reserved items (they are not given back, since the
+     * underlying queue may already have been cleared) and clears the
+     * underlying queue.
+     */
+    void clear() override {
+        {
+            std::unique_lock<tl::mutex> lock(m_mtx);
+            m_reserved.clear();
+            m_new_reservations.clear();
+            m_exhausted = true;
+        }
+        m_queue->clear();
+    }
+
+    private:
+
+    std::unique_ptr<AbstractWorkQueue> m_queue; // underlying work queue
+    size_t                  m_lookahead; // number of items to keep reserved
+    std::deque<std::string> m_reserved; // items reserved but not pulled yet
+    std::vector<std::string> m_new_reservations; // items not yet seen by take_new_reservations
+    bool                    m_exhausted = false; // underlying queue is empty
+    tl::mutex               m_mtx; // protects the above
+};
+
+#endif
@@ -0,0 +1,209 @@
+#ifndef __DATALOADER_PROFILER_H
+#define __DATALOADER_PROFILER_H
+
+#include <mpi.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <fstream>
+#include <algorithm>
+#include <unordered_map>
+
+/**
+ * The Profiler accumulates the time spent in each phase of the loading
+ * process, along with counts of calls, rows and row bytes, per product
+ * type when the phase concerns a product table. Counters are atomics so that
+ * workers can update them concurrently without locking. At the end of
+ * the run, report() gathers the counters of all processes and writes,
+ * for each counter, its total, min, mean, percentiles and max across
+ * processes, as JSON (if the file name ends with .json) or CSV.
+ */
+class Profiler {
+
+    public:
+
+    enum Phase {
+        PULL = 0,      // waiting for a work unit from the queue
+        OPEN,          // opening HDF5 files
+        READ,          // reading and decoding tables (T::from_hdf5)
+        CREATE_EVENTS, // creating events (SubRun::createEvent)
+        STORE,         // storing products (Event::store)
+        FLUSH,         // flushing WriteBatches
+        CLOSE,         // closing HDF5 files
+        NUM_PHASES
+    };
+
+    enum Metric {
+        TIME = 0, // nanoseconds (reported in seconds)
+        CALLS,
+        ROWS,
+        ROW_BYTES, // rows * sizeof(T): in-memory size of the decoded rows,
+                   // neither the bytes read from files nor those serialized
+        NUM_METRICS
+    };
+
+    /**
+     * Measures the time between its construction and its destruction.
+     */
+    class Timer {
+
+        public:
+
+        Timer(Profiler& profiler, Phase phase, int product = -1)
+        : m_profiler(profiler)
+        , m_phase(phase)
+        , m_product(product)
+        , m_start(std::chrono::steady_clock::now()) {}
+
+        ~Timer() {
+            auto t = std::chrono::steady_clock::now() - m_start;
+            m_profiler.add(m_phase, m_product, TIME,
+                std::chrono::duration_cast<std::chrono::nanoseconds>(t).count());
+            m_profiler.add(m_phase, m_product, CALLS, 1);
+        }
+
+        private:
+
+        Profiler&                             m_profiler;
+        Phase                                 m_phase;
+        int                                   m_product;
+        std::chrono::steady_clock::time_point m_start;
+    };
+
+    /**
+     * Sets the list of products, which must be the same on all processes.
+     */
+    void init(const std::vector<std::string>& product_names) {
+        m_product_names = product_names;
+        m_product_index.clear();
+        for(size_t i = 0; i < product_names.size(); i++)
+            m_product_index[product_names[i]] = i;
+        m_num_slots = NUM_PHASES * (product_names.size() + 1);
+        m_counters.reset(new std::atomic<uint64_t>[m_num_slots * NUM_METRICS]);
+        for(size_t i = 0; i < m_num_slots * NUM_METRICS; i++)
+            m_counters[i] = 0;
+    }
+
+    /**
+     * Returns the index of a product, or -1 if it is unknown.
+     */
+    int product_index(const std::string& product_name) const {
+        auto it = m_product_index.find(product_name);
+        return it == m_product_index.end() ? -1 : (int)it->second;
+    }
+
+    void add(Phase phase, int product, Metric metric, uint64_t value) {
+        if(!m_counters) return;
+        m_counters[_slot(phase, product) * NUM_METRICS + metric] += value;
+    }
+
+    /**
+     * Collective operation gathering the counters of all the processes
+     * of the communicator. The root process writes the report into the
+     * provided file. Returns false on the root if the file could not be
+     * written.
+     */
+    bool report(MPI_Comm comm, int root, const std::string& filename) const {
+        int rank, size;
+        MPI_Comm_rank(comm, &rank);
+        MPI_Comm_size(comm, &size);
+        size_t n = m_num_slots * NUM_METRICS;
+        std::vector<double> local(n), all;
+        for(size_t i = 0; i < n; i++)
+            local[i] = m_counters[i].load();
+        if(rank == root) all.resize(n * size);
+        MPI_Gather(local.data(), n, MPI_DOUBLE, all.data(), n, MPI_DOUBLE, root, comm);
+        if(rank != root) return true;
+
+        bool json = filename.size() >= 5 && filename.compare(filename.size() - 5, 5, ".json") == 0;
+        std::ofstream outfile(filename);
+        if(!outfile.good()) return false;
+        if(json) outfile << "[\n";
+        else outfile << "phase,product,metric,total,min,mean,p50,p90,p99,max\n";
+        bool first = true;
+        std::vector<double> values(size);
+        for(size_t slot = 0; slot < m_num_slots; slot++) {
+            for(int metric = 0; metric < NUM_METRICS; metric++) {
+                for(int r = 0; r < size; r++)
+                    values[r] = all[r * n + slot * NUM_METRICS + metric];
+                if(std::all_of(values.begin(), values.end(), [](double v) { return v == 0; }))
+                    continue;
+                if(metric == TIME)
+                    for(auto& v : values) v *= 1e-9;
+                Statistics s = _statistics(values);
+                std::string phase   = _phase_name(slot % NUM_PHASES);
+                std::string product = slot < NUM_PHASES ? "" : m_product_names[slot / NUM_PHASES - 1];
+                std::string metric_name = _metric_name(metric);
+                if(json) {
+                    if(!first) outfile << ",\n";
+                    outfile << "  {\"phase\": \"" << phase << "\", \"product\": \"" << product
+                            << "\", \"metric\": \"" << metric_name << "\", \"total\": " << s.total
+                            << ", \"min\": " << s.min << ", \"mean\": " << s.mean
+                            << ", \"p50\": " << s.p50 << ", \"p90\": " << s.p90
+                            << ", \"p99\": " << s.p99 << ", \"max\": " << s.max << ", \"per_rank\": [";
+                    for(int r = 0; r < size; r++)
+                        outfile << (r ? ", " : "") << values[r];
+                    outfile << "]}";
+                } else {
+                    outfile << phase << ',' << product << ',' << metric_name << ',' << s.total
+                            << ',' << s.min << ',' << s.mean << ',' << s.p50 << ',' << s.p90
+                            << ',' << s.p99 << ',' << s.max << '\n';
+                }
+                first = false;
+            }
+        }
+        if(json) outfile << "\n]\n";
+        return outfile.good();
+    }
+
+    private:
+
+    struct Statistics {
+        double total, min, mean, p50, p90, p99, max;
+    };
+
+    size_t _slot(Phase phase, int product) const {
+        return (product + 1) * NUM_PHASES + phase;
+    }
+
+    static Statistics _statistics(std::vector<double> values) {
+        std::sort(values.begin(), values.end());
+        auto percentile = [&values](double p) {
+            size_t i = (size_t)(p * (values.size() - 1) + 0.5);
+            return values[i];
+        };
+        Statistics s;
+        s.total = 0;
+        for(auto v : values) s.total += v;
+        s.min  = values.front();
+        s.max  = values.back();
+        s.mean = s.total / values.size();
+        s.p50  = percentile(0.50);
+        s.p90  = percentile(0.90);
+        s.p99  = percentile(0.99);
+        return s;
+    }
+
+    static const char* _phase_name(size_t phase) {
+        static const char* names[NUM_PHASES] = {
+            "pull", "open", "read", "create_events", "store", "flush", "close"
+        };
+        return names[phase];
+    }
+
+    static const char* _metric_name(size_t metric) {
+        static const char* names[NUM_METRICS] = {
+            "time", "calls", "rows", "row_bytes"
+        };
+        return names[metric];
+    }
+
+    std::vector<std::string>                   m_product_names; // products, in the same order on all processes
+    std::unordered_map<std::string, size_t>    m_product_index; // index of each product in m_product_names
+    size_t                                     m_num_slots = 0; // number of (phase, product) pairs
+    std::unique_ptr<std::atomic<uint64_t>[]>   m_counters; // counters of each slot
+};
+
+#endif
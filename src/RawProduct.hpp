@@ -0,0 +1,129 @@
+#ifndef __DATALOADER_RAW_PRODUCT_H
+#define __DATALOADER_RAW_PRODUCT_H
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
+#include <boost/serialization/split_member.hpp>
+#include <boost/serialization/level.hpp>
+#include <boost/serialization/tracking.hpp>
+
+/**
+ * Product stored instead of a std::vector<T> with --raw-layout, for
+ * trivially copyable types: the rows are kept as their bytes in memory
+ * after a small header, instead of being serialized field by field.
+ * Storing one only refers to the caller's rows, which are written with
+ * a single save_binary (or memcpy by to_bytes), without intermediate
+ * copy. The bytes are only meaningful for the same definition of T on
+ * the same architecture, which the header lets readers check.
+ */
+template<typename T>
+struct RawProduct {
+
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "RawProduct requires a trivially copyable type");
+
+    static constexpr uint32_t MAGIC   = 0x48505257; // "HPRW"
+    static constexpr uint32_t VERSION = 1;
+
+    uint32_t       magic    = MAGIC;
+    uint32_t       version  = VERSION;
+    uint64_t       row_size = sizeof(T);
+    uint64_t       count    = 0; // number of rows
+    const T*       rows     = nullptr; // rows to store, not owned
+    std::vector<T> loaded; // rows read by load()
+
+    RawProduct() = default;
+
+    RawProduct(const T* r, size_t n)
+    : count(n)
+    , rows(r) {}
+
+    /**
+     * Whether the header read by load() matches this definition of T.
+     */
+    bool valid() const {
+        return magic == MAGIC && version == VERSION && row_size == sizeof(T);
+    }
+
+    /**
+     * Bytes of a RawProduct of the given rows, identical to its
+     * serialization by a binary archive without header.
+     */
+    static std::string to_bytes(const T* r, size_t n) {
+        RawProduct<T> header;
+        header.count = n;
+        constexpr size_t header_size = sizeof(magic) + sizeof(version) + sizeof(row_size) + sizeof(count);
+        std::string bytes(header_size + n*sizeof(T), '\0');
+        char* p = &bytes[0];
+        std::memcpy(p, &header.magic, sizeof(magic));       p += sizeof(magic);
+        std::memcpy(p, &header.version, sizeof(version));   p += sizeof(version);
+        std::memcpy(p, &header.row_size, sizeof(row_size)); p += sizeof(row_size);
+        std::memcpy(p, &header.count, sizeof(count));       p += sizeof(count);
+        if(n) std::memcpy(p, r, n*sizeof(T));
+        return bytes;
+    }
+
+    template<typename Archive>
+    void save(Archive& ar, const unsigned int) const {
+        ar & magic;
+        ar & version;
+        ar & row_size;
+        ar & count;
+        if(count) ar.save_binary(rows, count*sizeof(T));
+    }
+
+    template<typename Archive>
+    void load(Archive& ar, const unsigned int) {
+        ar & magic;
+        ar & version;
+        ar & row_size;
+        ar & count;
+        loaded.clear();
+        if(!count) return;
+        if(!valid()) {
+            // the rows must still be consumed from the archive
+            std::vector<char> skipped(count*row_size);
+            ar.load_binary(skipped.data(), skipped.size());
+            return;
+        }
+        loaded.resize(count);
+        ar.load_binary(loaded.data(), count*sizeof(T));
+    }
+
+    BOOST_SERIALIZATION_SPLIT_MEMBER()
+};
+
+template<typename T>
+constexpr uint32_t RawProduct<T>::MAGIC;
+
+template<typename T>
+constexpr uint32_t RawProduct<T>::VERSION;
+
+/**
+ * Serialized without class information nor tracking, so that archives
+ * hold exactly the bytes produced by RawProduct::to_bytes.
+ */
+namespace boost {
+namespace serialization {
+
+template<typename T>
+struct implementation_level<RawProduct<T>> {
+    typedef mpl::integral_c_tag tag;
+    typedef mpl::int_<object_serializable> type;
+    BOOST_STATIC_CONSTANT(int, value = type::value);
+};
+
+template<typename T>
+struct tracking_level<RawProduct<T>> {
+    typedef mpl::integral_c_tag tag;
+    typedef mpl::int_<track_never> type;
+    BOOST_STATIC_CONSTANT(int, value = type::value);
+};
+
+}
+}
+
+#endif
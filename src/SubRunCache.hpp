@@ -0,0 +1,93 @@
+#ifndef __DATALOADER_SUBRUN_CACHE_H
+#define __DATALOADER_SUBRUN_CACHE_H
+
+#include <map>
+#include <vector>
+#include <utility>
+#include <mutex>
+#include <hepnos.hpp>
+#include <thallium.hpp>
+
+namespace tl = thallium;
+
+/**
+ * Handles of the runs and subruns of a DataSet, shared by the workers of
+ * a process. Runs and subruns are created through a WriteBatch, so that
+ * obtaining a handle never requires a synchronous RPC: those created up
+ * front by create(), or created by other processes and opened once by
+ * open(), are only looked up, and the others are created the first
+ * time they are needed (creating an existing run or subrun is harmless)
+ * and cached. The WriteBatch of such a creation must be flushed before
+ * events of the subrun are stored by another one.
+ */
+class SubRunCache {
+
+    public:
+
+    typedef std::pair<hepnos::RunNumber, hepnos::SubRunNumber> Key;
+
+    SubRunCache(const hepnos::DataSet& dataset)
+    : m_dataset(dataset) {}
+
+    /**
+     * Creates the provided runs and subruns in the WriteBatch
+     * and keeps their handles.
+     */
+    void create(const std::vector<Key>& subruns, hepnos::WriteBatch& batch) {
+        std::unique_lock<tl::mutex> lock(m_mtx);
+        for(auto& key : subruns) _create(key, batch);
+    }
+
+    /**
+     * Obtains the handles of runs and subruns that are not in the cache
+     * yet, typically created by other processes. HEPnOS only hands out
+     * handles of items it creates or looks up, and a lookup is a blocking
+     * RPC per item, so they are created again in the WriteBatch instead,
+     * which is harmless and costs a few batched RPCs at most.
+     */
+    void open(const std::vector<Key>& subruns, hepnos::WriteBatch& batch) {
+        std::unique_lock<tl::mutex> lock(m_mtx);
+        for(auto& key : subruns) {
+            if(m_subruns.count(key)) continue;
+            _create(key, batch);
+        }
+    }
+
+    /**
+     * Returns the handle of a subrun, creating it in the
+     * WriteBatch if it is not in the cache yet.
+     */
+    hepnos::SubRun get(hepnos::RunNumber run, hepnos::SubRunNumber subrun, hepnos::WriteBatch& batch) {
+        std::unique_lock<tl::mutex> lock(m_mtx);
+        auto it = m_subruns.find(Key(run, subrun));
+        if(it != m_subruns.end()) {
+            m_hits += 1;
+            return it->second;
+        }
+        m_misses += 1;
+        return _create(Key(run, subrun), batch);
+    }
+
+    uint64_t hits() const { return m_hits; }
+    uint64_t misses() const { return m_misses; }
+
+    private:
+
+    hepnos::SubRun _create(const Key& key, hepnos::WriteBatch& batch) {
+        auto run = m_runs.find(key.first);
+        if(run == m_runs.end())
+            run = m_runs.emplace(key.first, m_dataset.createRun(batch, key.first)).first;
+        hepnos::SubRun subrun = run->second.createSubRun(batch, key.second);
+        m_subruns[key] = subrun;
+        return subrun;
+    }
+
+    hepnos::DataSet                          m_dataset; // dataset containing the runs
+    std::map<hepnos::RunNumber, hepnos::Run> m_runs; // handles of the runs
+    std::map<Key, hepnos::SubRun>            m_subruns; // handles of the subruns
+    uint64_t                                 m_hits = 0; // calls to get() served from the cache
+    uint64_t                                 m_misses = 0; // calls to get() that created the subrun
+    tl::mutex                                m_mtx; // protects the above
+};
+
+#endif
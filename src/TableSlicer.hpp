@@ -0,0 +1,201 @@
+#ifndef __DATALOADER_TABLE_SLICER_H
+#define __DATALOADER_TABLE_SLICER_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <unistd.h>
+#include <hdf5.h>
+#include "HDF5Compat.hpp"
+
+/**
+ * The from_hdf5 functions of the NOvA classes read entire tables.
+ * The TableSlicer copies a range of rows of every dataset of a table's
+ * group into a new in-memory HDF5 file (core driver, no backing store)
+ * with the same layout, on which from_hdf5 can then be called to read
+ * only that range of rows.
+ *
+ * None of these functions are thread-safe unless HDF5 is.
+ */
+class TableSlicer {
+
+    public:
+
+    /**
+     * Returns the number of bytes one row occupies across all the
+     * datasets of the group, or 0 if the group does not exist.
+     */
+    static size_t row_size(hid_t file, const std::string& group) {
+        if(H5Lexists(file, group.c_str(), H5P_DEFAULT) <= 0) return 0;
+        hid_t src = H5Gopen(file, group.c_str(), H5P_DEFAULT);
+        size_t size = 0;
+        H5Literate(src, H5_INDEX_NAME, H5_ITER_NATIVE, nullptr, &_row_size_cb, &size);
+        H5Gclose(src);
+        return size;
+    }
+
+    /**
+     * Reads the event column ("evt" dataset) of the group.
+     */
+    static std::vector<unsigned> read_events(hid_t file, const std::string& group) {
+        std::vector<unsigned> events;
+        read_events(file, group, events);
+        return events;
+    }
+
+    /**
+     * Same as above, reading into the provided vector so
+     * that its storage can be reused across tables.
+     */
+    static void read_events(hid_t file, const std::string& group, std::vector<unsigned>& events) {
+        events.clear();
+        std::string path = group + "/evt";
+        if(H5Lexists(file, group.c_str(), H5P_DEFAULT) <= 0) return;
+        if(H5Lexists(file, path.c_str(), H5P_DEFAULT) <= 0) return;
+        hid_t dset = H5Dopen(file, path.c_str(), H5P_DEFAULT);
+        hid_t space = H5Dget_space(dset);
+        hsize_t dims[H5S_MAX_RANK];
+        int ndims = H5Sget_simple_extent_dims(space, dims, nullptr);
+        hsize_t count = 1;
+        for(int i = 0; i < ndims; i++) count *= dims[i];
+        events.resize(count);
+        if(count > 0)
+            H5Dread(dset, H5T_NATIVE_UINT, H5S_ALL, H5S_ALL, H5P_DEFAULT, events.data());
+        H5Sclose(space);
+        H5Dclose(dset);
+    }
+
+    /**
+     * Creates an in-memory HDF5 file containing rows [begin, end) of all
+     * the datasets in the group, under the same path. The returned file
+     * must be closed with H5Fclose. Returns a negative value on error.
+     * The transfer property list is used when reading from the source
+     * file (e.g. to request collective MPI-IO reads). If provided, buffer
+     * is used to hold the rows being copied instead of allocating memory
+     * for each dataset, and keeps its capacity for later calls.
+     */
+    static hid_t slice(hid_t file, const std::string& group,
+                       hsize_t begin, hsize_t end, hid_t dxpl = H5P_DEFAULT,
+                       std::vector<char>* buffer = nullptr) {
+        std::vector<char> local_buffer;
+        if(!buffer) buffer = &local_buffer;
+        static std::atomic<uint64_t> s_counter{0};
+        std::string name = "table-slice-" + std::to_string(getpid())
+                         + "-" + std::to_string(s_counter++) + ".h5";
+        hid_t fapl = H5Pcreate(H5P_FILE_ACCESS);
+        H5Pset_fapl_core(fapl, 1024*1024, 0);
+        hid_t dst_file = H5Fcreate(name.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, fapl);
+        H5Pclose(fapl);
+        if(dst_file < 0) return dst_file;
+        hid_t lcpl = H5Pcreate(H5P_LINK_CREATE);
+        H5Pset_create_intermediate_group(lcpl, 1);
+        hid_t dst = H5Gcreate(dst_file, group.c_str(), lcpl, H5P_DEFAULT, H5P_DEFAULT);
+        H5Pclose(lcpl);
+        hid_t src = H5Gopen(file, group.c_str(), H5P_DEFAULT);
+        SliceArgs args{dst, begin, end, dxpl, buffer, 0};
+        H5Literate(src, H5_INDEX_NAME, H5_ITER_NATIVE, nullptr, &_slice_cb, &args);
+        H5Gclose(src);
+        H5Gclose(dst);
+        if(args.status < 0) {
+            H5Fclose(dst_file);
+            return -1;
+        }
+        return dst_file;
+    }
+
+    private:
+
+    struct SliceArgs {
+        hid_t   dst;    // destination group
+        hsize_t begin;  // first row
+        hsize_t end;    // end of the range of rows
+        hid_t   dxpl;   // transfer property list for reads
+        std::vector<char>* buffer; // holds the rows being copied
+        herr_t  status; // negative if an error occured
+    };
+
+    static herr_t _row_size_cb(hid_t group, const char* name, const H5L_info_t*, void* op_data) {
+        size_t* size = static_cast<size_t*>(op_data);
+        H5O_type_t obj_type = HDF5Compat::object_type(group, name);
+        if(obj_type == H5O_TYPE_GROUP) {
+            hid_t sub = H5Gopen(group, name, H5P_DEFAULT);
+            H5Literate(sub, H5_INDEX_NAME, H5_ITER_NATIVE, nullptr, &_row_size_cb, op_data);
+            H5Gclose(sub);
+        } else if(obj_type == H5O_TYPE_DATASET) {
+            hid_t dset = H5Dopen(group, name, H5P_DEFAULT);
+            hid_t type = H5Dget_type(dset);
+            hid_t space = H5Dget_space(dset);
+            hsize_t dims[H5S_MAX_RANK];
+            int ndims = H5Sget_simple_extent_dims(space, dims, nullptr);
+            size_t row = H5Tget_size(type);
+            for(int i = 1; i < ndims; i++) row *= dims[i];
+            *size += row;
+            H5Sclose(space);
+            H5Tclose(type);
+            H5Dclose(dset);
+        }
+        return 0;
+    }
+
+    static herr_t _slice_cb(hid_t group, const char* name, const H5L_info_t*, void* op_data) {
+        SliceArgs* args = static_cast<SliceArgs*>(op_data);
+        H5O_type_t obj_type = HDF5Compat::object_type(group, name);
+        if(obj_type == H5O_TYPE_GROUP) {
+            hid_t sub = H5Gopen(group, name, H5P_DEFAULT);
+            hid_t dst_sub = H5Gcreate(args->dst, name, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+            SliceArgs sub_args{dst_sub, args->begin, args->end, args->dxpl, args->buffer, 0};
+            H5Literate(sub, H5_INDEX_NAME, H5_ITER_NATIVE, nullptr, &_slice_cb, &sub_args);
+            if(sub_args.status < 0) args->status = sub_args.status;
+            H5Gclose(dst_sub);
+            H5Gclose(sub);
+        } else if(obj_type == H5O_TYPE_DATASET) {
+            if(_slice_dataset(group, name, *args) < 0) args->status = -1;
+        }
+        return 0;
+    }
+
+    static herr_t _slice_dataset(hid_t group, const char* name, const SliceArgs& args) {
+        hid_t dset = H5Dopen(group, name, H5P_DEFAULT);
+        hid_t type = H5Dget_type(dset);
+        hid_t space = H5Dget_space(dset);
+        hsize_t dims[H5S_MAX_RANK];
+        int ndims = H5Sget_simple_extent_dims(space, dims, nullptr);
+        // select rows [begin, end) along the first dimension
+        hsize_t start[H5S_MAX_RANK] = {0};
+        hsize_t count[H5S_MAX_RANK];
+        for(int i = 0; i < ndims; i++) count[i] = dims[i];
+        if(ndims > 0) {
+            start[0] = std::min(args.begin, dims[0]);
+            count[0] = std::min(args.end, dims[0]) - start[0];
+        }
+        size_t num_elements = 1;
+        for(int i = 0; i < ndims; i++) num_elements *= count[i];
+        hid_t mem_space = H5Screate_simple(ndims, count, nullptr);
+        if(ndims > 0)
+            H5Sselect_hyperslab(space, H5S_SELECT_SET, start, nullptr, count, nullptr);
+        std::vector<char>& buffer = *args.buffer;
+        buffer.resize(std::max<size_t>(1, num_elements * H5Tget_size(type)));
+        herr_t ret = 0;
+        // With a non-default transfer property list the read may be collective,
+        // in which case every process must take part even if it reads no rows
+        if(num_elements > 0 || args.dxpl != H5P_DEFAULT)
+            ret = H5Dread(dset, type, mem_space, space, args.dxpl, buffer.data());
+        // write them into a dataset with the same type in the destination
+        hid_t dst_dset = H5Dcreate(args.dst, name, type, mem_space,
+                                   H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+        if(ret >= 0 && num_elements > 0)
+            ret = H5Dwrite(dst_dset, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, buffer.data());
+        if(H5Tdetect_class(type, H5T_VLEN) > 0
+        || (H5Tget_class(type) == H5T_STRING && H5Tis_variable_str(type) > 0))
+            HDF5Compat::reclaim(type, mem_space, buffer.data());
+        H5Dclose(dst_dset);
+        H5Sclose(mem_space);
+        H5Sclose(space);
+        H5Tclose(type);
+        H5Dclose(dset);
+        return ret;
+    }
+};
+
+#endif
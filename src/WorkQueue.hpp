@@ -3,37 +3,55 @@
 
 #include <limits>
 #include <queue>
+#include <deque>
+#include <vector>
 #include <mutex>
+#include <atomic>
 #include <exception>
 #include <mpi.h>
 #include <thallium.hpp>
+#include "AbstractWorkQueue.hpp"
 
 namespace tl = thallium;
 
-class WorkQueue {
+/**
+ * Work queue centralized at rank 0. Other ranks send their requests
+ * to a listener running on its own execution stream on rank 0.
+ *
+ * The listener never blocks in MPI: it keeps a non-blocking receive
+ * posted for the next request and polls it with MPI_Test, yielding in
+ * between. Pulls, which may have to wait for work, are each served by
+ * their own ULT, so a pull waiting on the queue does not delay the
+ * requests of other ranks; other requests are short and are served
+ * inline, in the order they arrive. Requests and their payloads use
+ * different tags so that a payload is never taken for a request.
+ * Since the listener calls MPI concurrently with the rest of the
+ * process, MPI_THREAD_MULTIPLE is required.
+ *
+ * Latency target: with 1000+ ranks pulling at once and work available,
+ * a pull should be served within 1 ms at the 99th percentile (the
+ * LATENCY line of the queue-benchmark target measures it). Serving a
+ * request costs a few microseconds, so the target allows a few hundred
+ * requests to be queued ahead of it; beyond that, use pull_bulk, a
+ * PrefetchingWorkQueue or the DistributedWorkQueue.
+ */
+class WorkQueue : public AbstractWorkQueue {
 
     public:
 
-    class EmptyQueueException : public std::exception {
+    class ThreadLevelException : public std::exception {
 
         public:
 
         const char* what() const noexcept {
-            return "Work queue is empty";
+            return "The centralized work queue requires MPI_THREAD_MULTIPLE";
         }
     };
 
-    class ReadOnlyQueueException : public std::exception {
-
-        public:
-
-        const char* what() const noexcept {
-            return "Work queue is read-only";
-        }
-    };
-
-    WorkQueue(MPI_Comm comm)
-    : m_comm(comm) {
+    WorkQueue(MPI_Comm comm, SchedulingPolicy policy = FIFO)
+    : m_comm(comm)
+    , m_policy(policy)
+    , m_queue(WorkItemCompare{policy}) {
         MPI_Comm_rank(comm, &m_rank);
         int size;
         MPI_Comm_size(comm, &size);
@@ -41,11 +59,15 @@ class WorkQueue {
         m_num_remote_writers = size-1;
     }
 
-    void start_listening() {
+    void start_listening() override {
+        int provided;
+        MPI_Query_thread(&provided);
+        if(m_num_remote_readers > 0 && provided < MPI_THREAD_MULTIPLE)
+            throw ThreadLevelException();
         _spawn_listener_thread();
     }
 
-    ~WorkQueue() {
+    ~WorkQueue() override {
         _notify_close();
         if(m_is_open_for_writes) readonly();
         if(m_rank == 0 && m_es.size() == 1) {
@@ -53,72 +75,128 @@ class WorkQueue {
         }
     }
 
-    void readonly() {
+    void readonly() override {
         if(!m_is_open_for_writes) return;
         if(m_rank == 0) {
             {
                 std::unique_lock<tl::mutex> lock(m_queue_mtx);
                 m_is_open_for_writes = false;
             }
-            m_queue_cv.notify_one();
+            m_queue_cv.notify_all();
         } else {
             uint8_t msg = CLOSE_QUEUE_WR;
-            MPI_Send(&msg, 1, MPI_UINT8_T, 0, 0, m_comm);
+            MPI_Send(&msg, 1, MPI_UINT8_T, 0, TAG_REQUEST, m_comm);
             m_is_open_for_writes = false;
         }
     }
 
-    void push(const std::string& work) {
+    void push(const std::string& work, uint64_t cost = 0) override {
         if(!m_is_open_for_writes) throw ReadOnlyQueueException();
         if(m_rank == 0) {
             {
                 std::unique_lock<tl::mutex> lock(m_queue_mtx);
-                m_queue.push(work);
+                _enqueue(work, cost);
             }
             m_queue_cv.notify_one();
         } else {
+            std::unique_lock<tl::mutex> lock(m_client_mtx);
             uint8_t msg = PUSH_WORK;
-            MPI_Send(&msg, 1, MPI_UINT8_T, 0, 0, m_comm);
-            uint64_t work_size = work.size();
-            MPI_Send(&work_size, 1, MPI_UINT64_T, 0, 0, m_comm);
-            MPI_Send(work.data(), work.size(), MPI_CHAR, 0, 0, m_comm);
+            MPI_Send(&msg, 1, MPI_UINT8_T, 0, TAG_REQUEST, m_comm);
+            uint64_t header[2] = { work.size(), cost };
+            MPI_Send(header, 2, MPI_UINT64_T, 0, TAG_DATA, m_comm);
+            MPI_Send(work.data(), work.size(), MPI_CHAR, 0, TAG_DATA, m_comm);
         }
     }
 
-    std::string pull() {
+    std::string pull() override {
         if(m_rank == 0) {
             std::string result;
             {
                 std::unique_lock<tl::mutex> lock(m_queue_mtx);
-                while(m_queue.empty() && _has_writers()) {
+                while(_queue_empty() && _has_writers()) {
                     m_queue_cv.wait(lock);
                 }
-                if(m_queue.empty() && !_has_writers()) throw EmptyQueueException();
-                result = m_queue.front();
-                m_queue.pop();
+                if(_queue_empty() && !_has_writers()) {
+                    // pull handlers may be waiting as well and must learn it too
+                    lock.unlock();
+                    m_queue_cv.notify_all();
+                    throw EmptyQueueException();
+                }
+                result = _dequeue();
             }
             m_queue_cv.notify_one();
             return result;
         } else {
+            std::unique_lock<tl::mutex> lock(m_client_mtx);
             uint8_t msg = PULL_WORK;
-            MPI_Send(&msg, 1, MPI_UINT8_T, 0, 0, m_comm);
+            MPI_Send(&msg, 1, MPI_UINT8_T, 0, TAG_REQUEST, m_comm);
             uint64_t work_size = 0;
-            MPI_Recv(&work_size, 1, MPI_UINT64_T, 0, 0, m_comm, MPI_STATUS_IGNORE);
+            MPI_Recv(&work_size, 1, MPI_UINT64_T, 0, TAG_DATA, m_comm, MPI_STATUS_IGNORE);
             if(work_size == std::numeric_limits<uint64_t>::max())
                 throw EmptyQueueException();
             std::string result(work_size, '\0');
-            MPI_Recv(const_cast<char*>(result.data()), work_size, MPI_CHAR, 0, 0,
+            MPI_Recv(const_cast<char*>(result.data()), work_size, MPI_CHAR, 0, TAG_DATA,
                      m_comm, MPI_STATUS_IGNORE);
             return result;
         }
     }
 
-    void clear() {
+    std::vector<std::string> pull_bulk(size_t max_items) override {
+        std::vector<std::string> result;
+        if(max_items == 0) return result;
         if(m_rank == 0) {
             {
                 std::unique_lock<tl::mutex> lock(m_queue_mtx);
-                decltype(m_queue) empty;
+                while(_queue_empty() && _has_writers()) {
+                    m_queue_cv.wait(lock);
+                }
+                if(_queue_empty() && !_has_writers()) {
+                    // pull handlers may be waiting as well and must learn it too
+                    lock.unlock();
+                    m_queue_cv.notify_all();
+                    throw EmptyQueueException();
+                }
+                while(!_queue_empty() && result.size() < max_items)
+                    result.push_back(_dequeue());
+            }
+            m_queue_cv.notify_one();
+        } else {
+            std::unique_lock<tl::mutex> lock(m_client_mtx);
+            uint8_t msg = PULL_BULK;
+            MPI_Send(&msg, 1, MPI_UINT8_T, 0, TAG_REQUEST, m_comm);
+            uint64_t max = max_items;
+            MPI_Send(&max, 1, MPI_UINT64_T, 0, TAG_DATA, m_comm);
+            result = _recv_work_list(0);
+            if(result.empty()) throw EmptyQueueException();
+        }
+        return result;
+    }
+
+    bool give_back(const std::vector<std::string>& work) override {
+        if(work.empty()) return true;
+        if(m_rank == 0) {
+            {
+                std::unique_lock<tl::mutex> lock(m_queue_mtx);
+                for(auto it = work.rbegin(); it != work.rend(); it++)
+                    m_returned.push_front(*it);
+            }
+            m_queue_cv.notify_all();
+        } else {
+            std::unique_lock<tl::mutex> lock(m_client_mtx);
+            uint8_t msg = GIVE_BACK;
+            MPI_Send(&msg, 1, MPI_UINT8_T, 0, TAG_REQUEST, m_comm);
+            _send_work_list(0, work);
+        }
+        return true;
+    }
+
+    void clear() override {
+        if(m_rank == 0) {
+            {
+                std::unique_lock<tl::mutex> lock(m_queue_mtx);
+                decltype(m_queue) empty(WorkItemCompare{m_policy});
                 std::swap(m_queue, empty);
+                m_returned.clear();
             }
             m_queue_cv.notify_all();
         }
@@ -130,21 +208,51 @@ class WorkQueue {
         PUSH_WORK,      // push work to the queue
         PULL_WORK,      // pull work from the queue
         CLOSE_QUEUE_WR, // close the queue for writing
-        CLOSE_QUEUE_RD  // close the queue for reading
+        CLOSE_QUEUE_RD, // close the queue for reading
+        PULL_BULK,      // pull multiple work items from the queue
+        GIVE_BACK       // return work items that were not processed
+    };
+
+    enum Tag {
+        TAG_REQUEST = 0, // type of a request (MessageType), sent to rank 0
+        TAG_DATA    = 1  // payload of a request or of a reply
     };
 
     // the following are relevant in all ranks
     MPI_Comm                 m_comm; // communicator
     int                      m_rank; // rank of current process
     bool                     m_is_open_for_writes = true; // this process can write
+    tl::mutex                m_client_mtx; // serializes requests sent to rank 0 by this process
+
+    struct WorkItem {
+        std::string work; // content of the work item
+        uint64_t    cost; // cost used by LONGEST_FIRST scheduling
+        uint64_t    seq;  // insertion order, used by FIFO and to break ties
+    };
+
+    struct WorkItemCompare {
+        SchedulingPolicy policy;
+        // returns true if a should be pulled after b
+        bool operator()(const WorkItem& a, const WorkItem& b) const {
+            if(policy == LONGEST_FIRST && a.cost != b.cost)
+                return a.cost < b.cost;
+            return a.seq > b.seq;
+        }
+    };
 
     // the following are relevant only in rank 0
-    std::queue<std::string>  m_queue; // work queue
+    SchedulingPolicy         m_policy; // order in which work is pulled
+    std::priority_queue<WorkItem,
+        std::vector<WorkItem>,
+        WorkItemCompare>     m_queue; // work queue
+    uint64_t                 m_next_seq = 0; // sequence number of the next work item
+    std::deque<std::string>  m_returned; // work given back, pulled before m_queue
     tl::mutex                m_queue_mtx; // mutex for the work queue
     tl::condition_variable   m_queue_cv; // cond var for the work queue
     int                      m_num_remote_writers; // number of active writers
     int                      m_num_remote_readers; // number of active readers
     std::vector<tl::managed<tl::xstream>> m_es; // execution stream to use for background MPI communications
+    std::atomic<int>         m_num_handlers{0}; // ULTs serving pulls that have not completed
 
     void _spawn_listener_thread() {
         m_es.push_back(tl::xstream::create());
@@ -156,22 +264,103 @@ class WorkQueue {
         m_es.clear();
     }
 
+    void _enqueue(std::string work, uint64_t cost) {
+        m_queue.push(WorkItem{std::move(work), cost, m_next_seq++});
+    }
+
+    std::string _dequeue() {
+        if(!m_returned.empty()) {
+            std::string work = std::move(m_returned.front());
+            m_returned.pop_front();
+            return work;
+        }
+        std::string work = std::move(const_cast<WorkItem&>(m_queue.top()).work);
+        m_queue.pop();
+        return work;
+    }
+
+    bool _queue_empty() const {
+        return m_queue.empty() && m_returned.empty();
+    }
+
+    // sends a list of work items as [count][sizes][data]
+    void _send_work_list(int dest, const std::vector<std::string>& work) {
+        std::vector<uint64_t> sizes(work.size()+1);
+        sizes[0] = work.size();
+        std::string data;
+        for(size_t i = 0; i < work.size(); i++) {
+            sizes[i+1] = work[i].size();
+            data += work[i];
+        }
+        MPI_Request requests[2];
+        MPI_Isend(sizes.data(), sizes.size(), MPI_UINT64_T, dest, TAG_DATA, m_comm, &requests[0]);
+        MPI_Isend(data.data(), data.size(), MPI_CHAR, dest, TAG_DATA, m_comm, &requests[1]);
+        _wait(requests[0]);
+        _wait(requests[1]);
+    }
+
+    // receives a list of work items sent by _send_work_list
+    std::vector<std::string> _recv_work_list(int source) {
+        MPI_Status status;
+        int flag = 0;
+        while(true) {
+            MPI_Iprobe(source, TAG_DATA, m_comm, &flag, &status);
+            if(flag) break;
+            tl::thread::yield();
+        }
+        int count = 0;
+        MPI_Get_count(&status, MPI_UINT64_T, &count);
+        std::vector<uint64_t> sizes(count);
+        MPI_Recv(sizes.data(), count, MPI_UINT64_T, source, TAG_DATA, m_comm, MPI_STATUS_IGNORE);
+        uint64_t total = 0;
+        for(int i = 1; i < count; i++) total += sizes[i];
+        std::string data(total, '\0');
+        MPI_Recv(const_cast<char*>(data.data()), total, MPI_CHAR, source, TAG_DATA,
+                 m_comm, MPI_STATUS_IGNORE);
+        std::vector<std::string> work;
+        size_t pos = 0;
+        for(int i = 1; i < count; i++) {
+            work.push_back(data.substr(pos, sizes[i]));
+            pos += sizes[i];
+        }
+        return work;
+    }
+
     bool _has_writers() const {
         return m_is_open_for_writes || (m_num_remote_writers > 0);
     }
 
+    // completes a non-blocking operation, yielding to other ULTs while it is pending
+    static void _wait(MPI_Request& request) {
+        int flag = 0;
+        while(true) {
+            MPI_Test(&request, &flag, MPI_STATUS_IGNORE);
+            if(flag) return;
+            tl::thread::yield();
+        }
+    }
+
     void _listen() {
+        uint8_t msg = 0;
+        MPI_Request request;
+        MPI_Irecv(&msg, 1, MPI_UINT8_T, MPI_ANY_SOURCE, TAG_REQUEST, m_comm, &request);
         while((m_num_remote_readers > 0) || (m_num_remote_writers > 0)) {
-            uint8_t msg;
+            int flag = 0;
             MPI_Status status;
-            MPI_Recv(&msg, 1, MPI_UINT8_T, MPI_ANY_SOURCE, 0, m_comm, &status);
+            MPI_Test(&request, &flag, &status);
+            if(!flag) {
+                tl::thread::yield();
+                continue;
+            }
             int source = status.MPI_SOURCE;
-            switch(msg) {
+            uint8_t type = msg;
+            MPI_Irecv(&msg, 1, MPI_UINT8_T, MPI_ANY_SOURCE, TAG_REQUEST, m_comm, &request);
+            switch(type) {
                 case PUSH_WORK:
                     _handle_push_work(source);
                     break;
                 case PULL_WORK:
-                    _handle_pull_work(source);
+                    _spawn_handler([this, source]() { _handle_pull_work(source); });
                     break;
                 case CLOSE_QUEUE_WR:
                     _handle_remove_writer();
@@ -179,45 +368,98 @@ class WorkQueue {
                 case CLOSE_QUEUE_RD:
                     _handle_remove_reader();
                     break;
+                case PULL_BULK:
+                    _spawn_handler([this, source]() { _handle_pull_bulk(source); });
+                    break;
+                case GIVE_BACK:
+                    _handle_give_back(source);
+                    break;
             }
         }
+        // all the clients are gone, the last receive will never complete
+        MPI_Cancel(&request);
+        MPI_Wait(&request, MPI_STATUS_IGNORE);
+        while(m_num_handlers > 0) tl::thread::yield();
     }
 
+    // serves a request in its own ULT on the listener's execution stream
+    template<typename F>
+    void _spawn_handler(F&& handler) {
+        m_num_handlers += 1;
+        m_es[0]->make_thread([this, handler]() {
+            handler();
+            m_num_handlers -= 1;
+        }, tl::anonymous());
+    }
+
+    // payloads of push requests are sent right after the request
+    // and are received inline, which keeps pushes ordered
     void _handle_push_work(int source) {
+        uint64_t header[2] = { 0, 0 };
+        MPI_Request request;
+        MPI_Irecv(header, 2, MPI_UINT64_T, source, TAG_DATA, m_comm, &request);
+        _wait(request);
+        std::string work(header[0], '\0');
+        MPI_Irecv(const_cast<char*>(work.data()), header[0], MPI_CHAR, source, TAG_DATA,
+                  m_comm, &request);
+        _wait(request);
         {
             std::unique_lock<tl::mutex> lock(m_queue_mtx);
-            uint64_t work_size = 0;
-            MPI_Recv(&work_size, 1, MPI_UINT64_T, source, 0, m_comm, MPI_STATUS_IGNORE);
-            std::string work(work_size, '\0');
-            MPI_Recv(const_cast<char*>(work.data()), work_size, MPI_CHAR, source, 0,
-                     m_comm, MPI_STATUS_IGNORE);
-            m_queue.push(std::move(work));
+            _enqueue(std::move(work), header[1]);
         }
         m_queue_cv.notify_one();
     }
 
     void _handle_pull_work(int source) {
         std::string work;
+        uint64_t work_size;
         {
             std::unique_lock<tl::mutex> lock(m_queue_mtx);
-            while(m_queue.empty() && _has_writers()) {
+            while(_queue_empty() && _has_writers()) {
                 m_queue_cv.wait(lock);
             }
-            if(m_queue.empty() && !_has_writers()) {
-                uint64_t work_size = std::numeric_limits<uint64_t>::max();
-                lock.unlock();
-                m_queue_cv.notify_one();
-                MPI_Send(&work_size, 1, MPI_UINT64_T, source, 0, m_comm);
-                return;
+            if(_queue_empty() && !_has_writers()) {
+                work_size = std::numeric_limits<uint64_t>::max();
             } else {
-                work = m_queue.front();
-                m_queue.pop();
+                work = _dequeue();
+                work_size = work.size();
             }
         }
         m_queue_cv.notify_one();
-        uint64_t work_size = work.size();
-        MPI_Send(&work_size, 1, MPI_UINT64_T, source, 0, m_comm);
-        MPI_Send(work.data(), work_size, MPI_CHAR, source, 0, m_comm);
+        MPI_Request requests[2];
+        MPI_Isend(&work_size, 1, MPI_UINT64_T, source, TAG_DATA, m_comm, &requests[0]);
+        _wait(requests[0]);
+        if(work_size == std::numeric_limits<uint64_t>::max()) return;
+        MPI_Isend(work.data(), work_size, MPI_CHAR, source, TAG_DATA, m_comm, &requests[1]);
+        _wait(requests[1]);
+    }
+
+    void _handle_pull_bulk(int source) {
+        uint64_t max_items = 0;
+        MPI_Request request;
+        MPI_Irecv(&max_items, 1, MPI_UINT64_T, source, TAG_DATA, m_comm, &request);
+        _wait(request);
+        std::vector<std::string> work;
+        {
+            std::unique_lock<tl::mutex> lock(m_queue_mtx);
+            while(_queue_empty() && _has_writers()) {
+                m_queue_cv.wait(lock);
+            }
+            while(!_queue_empty() && work.size() < max_items)
+                work.push_back(_dequeue());
+        }
+        m_queue_cv.notify_one();
+        _send_work_list(source, work);
+    }
+
+    void _handle_give_back(int source) {
+        auto work = _recv_work_list(source);
+        {
+            std::unique_lock<tl::mutex> lock(m_queue_mtx);
+            for(auto it = work.rbegin(); it != work.rend(); it++)
+                m_returned.push_front(*it);
+        }
+        m_queue_cv.notify_all();
     }
 
     void _handle_remove_reader() {
@@ -225,7 +467,7 @@ class WorkQueue {
             std::unique_lock<tl::mutex> lock(m_queue_mtx);
             m_num_remote_readers -= 1;
         }
-        m_queue_cv.notify_one();
+        m_queue_cv.notify_all();
     }
 
     void _handle_remove_writer() {
@@ -233,13 +475,13 @@ class WorkQueue {
             std::unique_lock<tl::mutex> lock(m_queue_mtx);
             m_num_remote_writers -= 1;
         }
-        m_queue_cv.notify_one();
+        m_queue_cv.notify_all();
     }
 
     void _notify_close() {
         if(m_rank != 0) {
             uint8_t msg = CLOSE_QUEUE_RD;
-            MPI_Send(&msg, 1, MPI_UINT8_T, 0, 0, m_comm);
+            MPI_Send(&msg, 1, MPI_UINT8_T, 0, TAG_REQUEST, m_comm);
         }
     }
 };
@@ -0,0 +1,50 @@
+#ifndef __DATALOADER_WORK_UNIT_H
+#define __DATALOADER_WORK_UNIT_H
+
+#include <string>
+#include <sstream>
+
+/**
+ * A WorkUnit is what goes through the work queue. It designates either
+ * an entire file (product is empty), a single product table of a file,
+ * or a range of rows of a product table. Row ranges are realigned on
+ * event boundaries by the process handling them: a unit owns the events
+ * whose first row falls within [begin, end).
+ *
+ * A unit covering an entire file is serialized as just the file name,
+ * other units as "filename\tproduct\tbegin\tend".
+ */
+struct WorkUnit {
+
+    std::string filename; // HDF5 file
+    std::string product;  // product to load, empty for all the products
+    uint64_t    begin = 0; // first row of the range
+    uint64_t    end = 0;   // end of the range, 0 for the end of the table
+
+    bool is_whole_file() const {
+        return product.empty();
+    }
+
+    std::string to_string() const {
+        if(is_whole_file()) return filename;
+        std::stringstream ss;
+        ss << filename << '\t' << product << '\t' << begin << '\t' << end;
+        return ss.str();
+    }
+
+    static WorkUnit from_string(const std::string& str) {
+        WorkUnit unit;
+        std::stringstream ss(str);
+        std::getline(ss, unit.filename, '\t');
+        std::string begin, end;
+        if(std::getline(ss, unit.product, '\t')
+        && std::getline(ss, begin, '\t')
+        && std::getline(ss, end, '\t')) {
+            unit.begin = std::stoull(begin);
+            unit.end   = std::stoull(end);
+        }
+        return unit;
+    }
+};
+
+#endif